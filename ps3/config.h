@@ -53,15 +53,24 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (8 or 16). Override with -DALIGNMENT=16
+ * to build mm.c and the driver for 16-byte alignment.
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8  
+#endif
 
 /* 
- * Maximum heap size in bytes 
+ * Default maximum heap size in bytes (mdriver -M overrides it)
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/* 
+ * Most bytes the heap may keep once a trace has freed every block, in
+ * builds that trim the heap (not -DTHREAD_SAFE=1 or -DLOCKFREE=1)
+ */
+#define IDLE_HEAP (256*(1<<10))  /* 256 KB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
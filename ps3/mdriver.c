@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -31,7 +32,14 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
+
+/* Threaded replays run at most this many threads */
+#define MAX_THREADS 64
+#define MAX_REGIONS 8      /* regions a trace can allocate from */
+
+/* Byte a thread fills the payload of block index with in a threaded replay */
+#define TAG(index, thread) (((index) + 37*(thread)) & 0xFF)
 
 /****************************** 
  * The key compound data types 
@@ -46,9 +54,15 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN, CALLOC, HINT,
+	  BATCH, FREE_BATCH,
+	  REGION_ALLOC, REGION_RESET} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of memalign request */
+    int hint;                         /* lifetime hint of hinted request */
+    int count;                        /* number of blocks of batch request */
+    int region;                       /* region of region alloc/reset request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -60,6 +74,7 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    int *block_regions;  /* region each block came from, or -1 */
 } trace_t;
 
 /* 
@@ -72,6 +87,20 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* One thread of a threaded replay, which replays the whole trace on its own
+   blocks and hands every other block to the next thread to free */
+typedef struct {
+    trace_t *trace;      /* the trace to replay */
+    int thread;          /* number of this thread, from 0 */
+    int check;           /* check each block and its payload? */
+    char **blocks;       /* this thread's blocks... */
+    size_t *block_sizes; /* ... and their payload sizes */
+    int *block_regions;  /* ... and regions, or -1 */
+    mm_region_t *regions[MAX_REGIONS]; /* this thread's regions */
+    int opnum;           /* request that went wrong, if any... */
+    char *msg;           /* ... and what did, or NULL */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +110,8 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double heap;     /* heap plus region bytes at the end of the trace */
+    double peak;     /* peak heap plus region bytes during the trace */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -92,6 +123,12 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* Threads that replay each trace at once (set by -T), 0 for one replay */
+static int nthreads = 0;
+
+/* Blocks handed to each thread to free, linked through their first word */
+static void *handoff[MAX_THREADS];
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -125,6 +162,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for replaying a trace in several threads at once */
+static int eval_mm_threads(trace_t *trace, int tracenum);
+static void eval_mm_threads_speed(void *ptr);
+static int run_threads(trace_t *trace, int tracenum, int check);
+static void *replay_thread(void *ptr);
+static void handoff_push(int thread, void *p);
+static void handoff_drain(int thread);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
 static void usage(void);
@@ -150,6 +195,7 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    size_t max_heap = MAX_HEAP; /* Heap limit in bytes (set by -M) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +204,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:M:T:hvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,6 +224,23 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'M': /* Heap limit in megabytes */
+	    max_heap = (size_t)atol(optarg) << 20;
+	    if (max_heap == 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'T': /* Replay each trace in several threads at once */
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1 || nthreads > MAX_THREADS) {
+		usage();
+		exit(1);
+	    }
+#if !THREAD_SAFE && !LOCKFREE
+	    app_error("mdriver: -T needs a build with -DTHREAD_SAFE=1 or -DLOCKFREE=1");
+#endif
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
@@ -285,7 +348,7 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
+    mem_init(max_heap); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
@@ -293,16 +356,24 @@ int main(int argc, char **argv)
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges) &&
+	    (nthreads == 0 || eval_mm_threads(trace, i));
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].heap = mem_heapsize() + mem_mapsize();
+	    mm_stats[i].peak = mem_peakheapsize();
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (nthreads > 0) {
+		mm_stats[i].ops = (double)trace->num_ops * nthreads;
+		mm_stats[i].secs = fsecs(eval_mm_threads_speed, &speed_params);
+	    }
+	    else
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
 	}
 	free_trace(trace);
     }
@@ -395,9 +466,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or in a region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_in_region(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -477,7 +549,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align, count, region, hint;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -514,6 +586,11 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+
+    /* ... and the region of each block that came from one */
+    if ((trace->block_regions = 
+	 (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+	unix_error("malloc 5 failed in read_trace");
     
     /* read every request line in the trace file */
     index = 0;
@@ -534,11 +611,67 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'h':
+	    fscanf(tracefile, "%u %u %u", &index, &hint, &size);
+	    trace->ops[op_index].type = HINT;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].hint = hint;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].align = align;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'b':
+	    fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    trace->ops[op_index].type = BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    trace->ops[op_index].size = size;
+	    index += count - 1;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'o':
+	    fscanf(tracefile, "%u %u %u", &index, &region, &size);
+	    if (region >= MAX_REGIONS)
+		app_error("Region number too large in read_trace");
+	    trace->ops[op_index].type = REGION_ALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].region = region;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'z':
+	    fscanf(tracefile, "%u", &region);
+	    if (region >= MAX_REGIONS)
+		app_error("Region number too large in read_trace");
+	    trace->ops[op_index].type = REGION_RESET;
+	    trace->ops[op_index].index = 0;
+	    trace->ops[op_index].region = region;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 'B':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    trace->ops[op_index].type = FREE_BATCH;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
@@ -555,14 +688,15 @@ static trace_t *read_trace(char *tracedir, char *filename)
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
+ * free_trace - Free the trace record and the four arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    free(trace->ops);         /* free the four arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    free(trace->block_regions);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -579,14 +713,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     int i, j;
     int index;
     int size;
+    int count;
+    int region;
     int oldsize;
+    size_t usable;
+    mm_region_t *regions[MAX_REGIONS] = {NULL};
     char *newp;
     char *oldp;
     char *p;
+    char msg[MAXLINE];
     
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     clear_ranges(ranges);
+    memset(trace->block_regions, -1, trace->num_ids * sizeof(int));
 
     /* Call the mm package's init function */
     if (mm_init() < 0) {
@@ -602,19 +742,57 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+        case HINT: /* mm_malloc_hint */
+
+	    /* Call the student's malloc, memalign, calloc or malloc_hint */
+	    if (trace->ops[i].type == ALLOC)
+		p = mm_malloc(size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (trace->ops[i].type == HINT)
+		p = mm_malloc_hint(size, trace->ops[i].hint);
+	    else
+		p = mm_calloc(1, size);
+	    if (p == NULL) {
+		malloc_error(tracenum, i, trace->ops[i].type == ALLOC ?
+			     "mm_malloc failed." : trace->ops[i].type == MEMALIGN ?
+			     "mm_memalign failed." : trace->ops[i].type == HINT ?
+			     "mm_malloc_hint failed." : "mm_calloc failed.");
+		return 0;
+	    }
+
+	    /* A calloc'ed payload must read as zero */
+	    if (trace->ops[i].type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not zero the block");
+			return 0;
+		    }
+		}
+	    }
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    /* An aligned payload must be aligned as requested, too */
+	    if (trace->ops[i].type == MEMALIGN && 
+		((size_t)p % trace->ops[i].align) != 0) {
+		sprintf(msg, "Payload address (%p) not aligned to %d bytes",
+			p, trace->ops[i].align);
+		malloc_error(tracenum, i, msg);
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
 	     * to the range list if OK. The block must be  be aligned properly,
-	     * and must not overlap any currently allocated block. 
+	     * and must not overlap any currently allocated block. The range
+	     * is all of the block's usable bytes, which must cover the request.
 	     */ 
-	    if (add_range(ranges, p, size, tracenum, i) == 0)
+	    if ((usable = mm_malloc_usable_size(p)) < size) {
+		malloc_error(tracenum, i, "mm_malloc_usable_size is smaller than the request");
+		return 0;
+	    }
+	    if (add_range(ranges, p, usable, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -642,7 +820,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    remove_range(ranges, oldp);
 	    
 	    /* Check new block for correctness and add it to range list */
-	    if (add_range(ranges, newp, size, tracenum, i) == 0)
+	    if ((usable = mm_malloc_usable_size(newp)) < size) {
+		malloc_error(tracenum, i, "mm_malloc_usable_size is smaller than the request");
+		return 0;
+	    }
+	    if (add_range(ranges, newp, usable, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
@@ -668,10 +850,98 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from list and call student's free function,
+	       passing the size for every other block */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    if (index % 2)
+		mm_free_sized(p, trace->block_sizes[index]);
+	    else
+		mm_free(p);
+	    break;
+
+        case BATCH: /* mm_malloc_batch */
+
+	    /* Call the student's batch malloc for blocks index and up, and
+	       check each of them like a block from mm_malloc */
+	    count = trace->ops[i].count;
+	    if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) != count) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = index; j < index + count; j++) {
+		p = trace->blocks[j];
+		if ((usable = mm_malloc_usable_size(p)) < size) {
+		    malloc_error(tracenum, i, "mm_malloc_usable_size is smaller than the request");
+		    return 0;
+		}
+		if (add_range(ranges, p, usable, tracenum, i) == 0)
+		    return 0;
+		memset(p, j & 0xFF, size);
+		trace->block_sizes[j] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+
+	    /* The payloads must still hold what was written in them */
+	    count = trace->ops[i].count;
+	    for (j = index; j < index + count; j++) {
+		p = trace->blocks[j];
+		for (oldsize = 0; oldsize < trace->block_sizes[j]; oldsize++) {
+		    if (p[oldsize] != (char)(j & 0xFF)) {
+			malloc_error(tracenum, i, "Payload overwritten before mm_free_batch");
+			return 0;
+		    }
+		}
+		remove_range(ranges, p);
+	    }
+	    mm_free_batch((void **)&trace->blocks[index], count);
+	    break;
+
+        case REGION_ALLOC: /* mm_region_alloc */
+
+	    /* Regions are created as the trace first uses them */
+	    region = trace->ops[i].region;
+	    if (regions[region] == NULL &&
+		(regions[region] = mm_region_create()) == NULL) {
+		malloc_error(tracenum, i, "mm_region_create failed.");
+		return 0;
+	    }
+	    if ((p = mm_region_alloc(regions[region], size)) == NULL) {
+		malloc_error(tracenum, i, "mm_region_alloc failed.");
+		return 0;
+	    }
+
+	    /* Region bytes have no usable size, so check just the request */
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    trace->block_regions[index] = region;
+	    break;
+
+        case REGION_RESET: /* mm_region_reset */
+
+	    /* Every block from the region must still hold what was
+	       written in it, and goes away with the reset */
+	    region = trace->ops[i].region;
+	    for (j = 0; j < trace->num_ids; j++) {
+		if (trace->block_regions[j] != region)
+		    continue;
+		p = trace->blocks[j];
+		for (oldsize = 0; oldsize < trace->block_sizes[j]; oldsize++) {
+		    if (p[oldsize] != (char)(j & 0xFF)) {
+			malloc_error(tracenum, i, "Payload overwritten before mm_region_reset");
+			return 0;
+		    }
+		}
+		remove_range(ranges, p);
+		trace->block_regions[j] = -1;
+	    }
+	    if (regions[region] != NULL)
+		mm_region_reset(regions[region]);
 	    break;
 
 	default:
@@ -680,6 +950,20 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
     }
 
+    for (region = 0; region < MAX_REGIONS; region++)
+	if (regions[region] != NULL)
+	    mm_region_destroy(regions[region]);
+
+#if !THREAD_SAFE && !LOCKFREE
+    /* Once every block is freed, the heap must have been trimmed */
+    if (*ranges == NULL && mem_heapsize() > IDLE_HEAP) {
+	sprintf(msg, "Heap still has %lu bytes once every block is freed",
+		(unsigned long)mem_heapsize());
+	malloc_error(tracenum, trace->num_ops - 1, msg);
+	return 0;
+    }
+#endif
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
@@ -689,10 +973,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak size of the heap in bytes, including the regions mapped with
+ *   mem_map(), while running the student's malloc package on the trace.
+ *   Our mem_trim() lets the students decrement the brk pointer, so the
+ *   final heap size can be smaller than that; printresults shows both.
  *   
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
@@ -700,25 +984,42 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int i;
     int index;
     int size, newsize, oldsize;
+    int j, count, region;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    mm_region_t *regions[MAX_REGIONS] = {NULL};
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    memset(trace->block_regions, -1, trace->num_ids * sizeof(int));
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+        case HINT: /* mm_malloc_hint */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
-		app_error("mm_malloc failed in eval_mm_util");
+	    if (trace->ops[i].type == ALLOC)
+		p = mm_malloc(size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (trace->ops[i].type == HINT)
+		p = mm_malloc_hint(size, trace->ops[i].hint);
+	    else
+		p = mm_calloc(1, size);
+	    if (p == NULL) 
+		app_error(trace->ops[i].type == ALLOC ? "mm_malloc failed in eval_mm_util" :
+			  trace->ops[i].type == MEMALIGN ? "mm_memalign failed in eval_mm_util" :
+			  trace->ops[i].type == HINT ? "mm_malloc_hint failed in eval_mm_util" :
+			  "mm_calloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
 	    trace->blocks[index] = p;
@@ -768,13 +1069,72 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case BATCH: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    count = trace->ops[i].count;
+
+	    if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) != count)
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = index; j < index + count; j++)
+		trace->block_sizes[j] = size;
+
+	    total_size += size * count;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    count = trace->ops[i].count;
+
+	    for (j = index; j < index + count; j++)
+		total_size -= trace->block_sizes[j];
+	    mm_free_batch((void **)&trace->blocks[index], count);
+	    break;
+
+        case REGION_ALLOC: /* mm_region_alloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    region = trace->ops[i].region;
+
+	    if (regions[region] == NULL &&
+		(regions[region] = mm_region_create()) == NULL)
+		app_error("mm_region_create failed in eval_mm_util");
+	    if (mm_region_alloc(regions[region], size) == NULL)
+		app_error("mm_region_alloc failed in eval_mm_util");
+	    trace->block_sizes[index] = size;
+	    trace->block_regions[index] = region;
+
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case REGION_RESET: /* mm_region_reset */
+	    region = trace->ops[i].region;
+
+	    for (j = 0; j < trace->num_ids; j++) {
+		if (trace->block_regions[j] == region) {
+		    total_size -= trace->block_sizes[j];
+		    trace->block_regions[j] = -1;
+		}
+	    }
+	    if (regions[region] != NULL)
+		mm_region_reset(regions[region]);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    for (region = 0; region < MAX_REGIONS; region++)
+	if (regions[region] != NULL)
+	    mm_region_destroy(regions[region]);
+
+    return ((double)max_total_size / (double)mem_peakheapsize());
 }
 
 
@@ -784,9 +1144,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index, size, newsize, region;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    mm_region_t *regions[MAX_REGIONS] = {NULL};
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
@@ -805,6 +1166,30 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case HINT: /* mm_malloc_hint */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_malloc_hint(size, trace->ops[i].hint)) == NULL)
+		app_error("mm_malloc_hint error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -820,9 +1205,320 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (mm_malloc_batch(size, trace->ops[i].count,
+                                (void **)&trace->blocks[index]) != trace->ops[i].count)
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+            break;
+
+        case REGION_ALLOC: /* mm_region_alloc */
+            region = trace->ops[i].region;
+            if (regions[region] == NULL &&
+                (regions[region] = mm_region_create()) == NULL)
+		app_error("mm_region_create error in eval_mm_speed");
+            if (mm_region_alloc(regions[region], trace->ops[i].size) == NULL)
+		app_error("mm_region_alloc error in eval_mm_speed");
+            break;
+
+        case REGION_RESET: /* mm_region_reset */
+            region = trace->ops[i].region;
+            if (regions[region] != NULL)
+                mm_region_reset(regions[region]);
+            break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+
+    for (region = 0; region < MAX_REGIONS; region++)
+	if (regions[region] != NULL)
+	    mm_region_destroy(regions[region]);
+}
+
+/*
+ * eval_mm_threads - Check the mm malloc package for correctness when
+ *    nthreads threads replay the trace at once, each on blocks of its own
+ *    filled with a byte of its own. Every other block is freed by the next
+ *    thread over, to exercise frees from threads that don't own the block.
+ *    The heap must be consistent once every block is freed.
+ */
+static int eval_mm_threads(trace_t *trace, int tracenum)
+{
+    if (run_threads(trace, tracenum, 1) == 0)
+	return 0;
+    if (mm_checkheap() != 0) {
+	malloc_error(tracenum, trace->num_ops - 1,
+		     "mm_checkheap failed after the threaded replay");
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_threads_speed - This is the function that is used by fcyc()
+ *    to measure the running time of nthreads threaded replays.
+ */
+static void eval_mm_threads_speed(void *ptr)
+{
+    run_threads(((speed_t *)ptr)->trace, 0, 0);
+}
+
+/*
+ * run_threads - Reset the heap and replay the trace in nthreads threads
+ *    at once, checking their blocks if check is set, then free the blocks
+ *    still handed over. Returns 0 if a thread found an error.
+ */
+static int run_threads(trace_t *trace, int tracenum, int check)
+{
+    pthread_t tid[MAX_THREADS];
+    replay_t replay[MAX_THREADS];
+    int i, ok = 1;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in run_threads");
+
+    for (i = 0; i < nthreads; i++) {
+	replay[i].trace = trace;
+	replay[i].thread = i;
+	replay[i].check = check;
+	replay[i].msg = NULL;
+	memset(replay[i].regions, 0, sizeof(replay[i].regions));
+	if ((replay[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL ||
+	    (replay[i].block_sizes = calloc(trace->num_ids, sizeof(size_t))) == NULL ||
+	    (replay[i].block_regions = malloc(trace->num_ids * sizeof(int))) == NULL)
+	    unix_error("calloc failed in run_threads");
+	memset(replay[i].block_regions, -1, trace->num_ids * sizeof(int));
+	if (pthread_create(&tid[i], NULL, replay_thread, &replay[i]) != 0)
+	    unix_error("pthread_create failed in run_threads");
+    }
+
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tid[i], NULL);
+	if (replay[i].msg != NULL) {
+	    malloc_error(tracenum, replay[i].opnum, replay[i].msg);
+	    ok = 0;
+	}
+	free(replay[i].blocks);
+	free(replay[i].block_sizes);
+	free(replay[i].block_regions);
+    }
+    for (i = 0; i < nthreads; i++)
+	handoff_drain(i);
+    return ok;
+}
+
+/*
+ * replay_thread - Replay the trace for one thread of a threaded replay.
+ *    Stops at the first request that goes wrong, recording it.
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_t *r = (replay_t *)ptr;
+    trace_t *trace = r->trace;
+    int i, j, index, size, oldsize, count, region;
+    unsigned char tag;
+    char *p, *newp;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	handoff_drain(r->thread);
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	tag = TAG(index, r->thread);
+	r->opnum = i;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+        case HINT: /* mm_malloc_hint */
+	    if (trace->ops[i].type == ALLOC)
+		p = mm_malloc(size);
+	    else if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (trace->ops[i].type == HINT)
+		p = mm_malloc_hint(size, trace->ops[i].hint);
+	    else
+		p = mm_calloc(1, size);
+	    if (p == NULL) {
+		r->msg = "mm_malloc, mm_memalign, mm_calloc or mm_malloc_hint failed in a thread";
+		return NULL;
+	    }
+	    if (r->check) {
+		if (!IS_ALIGNED(p) || (trace->ops[i].type == MEMALIGN &&
+				       (size_t)p % trace->ops[i].align != 0)) {
+		    r->msg = "Payload address not aligned in a thread";
+		    return NULL;
+		}
+		if (mm_malloc_usable_size(p) < size) {
+		    r->msg = "mm_malloc_usable_size is smaller than the request in a thread";
+		    return NULL;
+		}
+		for (j = 0; trace->ops[i].type == CALLOC && j < size; j++) {
+		    if (p[j] != 0) {
+			r->msg = "mm_calloc did not zero the block in a thread";
+			return NULL;
+		    }
+		}
+		memset(p, tag, size);
+	    }
+	    r->blocks[index] = p;
+	    r->block_sizes[index] = size;
+	    break;
+
+        case REALLOC: /* mm_realloc */
+	    if ((newp = mm_realloc(r->blocks[index], size)) == NULL) {
+		r->msg = "mm_realloc failed in a thread";
+		return NULL;
+	    }
+	    if (r->check) {
+		oldsize = r->block_sizes[index];
+		if (size < oldsize) oldsize = size;
+		for (j = 0; j < oldsize; j++) {
+		    if ((unsigned char)newp[j] != tag) {
+			r->msg = "mm_realloc did not preserve the data from old block in a thread";
+			return NULL;
+		    }
+		}
+		memset(newp, tag, size);
+	    }
+	    r->blocks[index] = newp;
+	    r->block_sizes[index] = size;
+	    break;
+
+        case FREE: /* mm_free */
+
+	    /* The payload must still hold what this thread wrote in it */
+	    p = r->blocks[index];
+	    for (j = 0; r->check && j < r->block_sizes[index]; j++) {
+		if ((unsigned char)p[j] != tag) {
+		    r->msg = "Payload overwritten while allocated in a thread";
+		    return NULL;
+		}
+	    }
+	    if (index % 2 && nthreads > 1)
+		handoff_push((r->thread + 1) % nthreads, p);
+	    else
+		mm_free(p);
+	    break;
+
+        case BATCH: /* mm_malloc_batch */
+	    count = trace->ops[i].count;
+	    if (mm_malloc_batch(size, count, (void **)&r->blocks[index]) != count) {
+		r->msg = "mm_malloc_batch failed in a thread";
+		return NULL;
+	    }
+	    for (j = index; j < index + count; j++) {
+		if (r->check) {
+		    if (mm_malloc_usable_size(r->blocks[j]) < size) {
+			r->msg = "mm_malloc_usable_size is smaller than the request in a thread";
+			return NULL;
+		    }
+		    memset(r->blocks[j], TAG(j, r->thread), size);
+		}
+		r->block_sizes[j] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    count = trace->ops[i].count;
+	    for (j = index; r->check && j < index + count; j++) {
+		for (oldsize = 0; oldsize < r->block_sizes[j]; oldsize++) {
+		    if ((unsigned char)r->blocks[j][oldsize] != TAG(j, r->thread)) {
+			r->msg = "Payload overwritten while allocated in a thread";
+			return NULL;
+		    }
+		}
+	    }
+	    mm_free_batch((void **)&r->blocks[index], count);
+	    break;
+
+        case REGION_ALLOC: /* mm_region_alloc */
+	    region = trace->ops[i].region;
+	    if (r->regions[region] == NULL &&
+		(r->regions[region] = mm_region_create()) == NULL) {
+		r->msg = "mm_region_create failed in a thread";
+		return NULL;
+	    }
+	    if ((p = mm_region_alloc(r->regions[region], size)) == NULL) {
+		r->msg = "mm_region_alloc failed in a thread";
+		return NULL;
+	    }
+	    if (r->check) {
+		if (!IS_ALIGNED(p)) {
+		    r->msg = "Payload address not aligned in a thread";
+		    return NULL;
+		}
+		memset(p, tag, size);
+	    }
+	    r->blocks[index] = p;
+	    r->block_sizes[index] = size;
+	    r->block_regions[index] = region;
+	    break;
+
+        case REGION_RESET: /* mm_region_reset */
+	    region = trace->ops[i].region;
+	    for (j = 0; j < trace->num_ids; j++) {
+		if (r->block_regions[j] != region)
+		    continue;
+		for (oldsize = 0; r->check && oldsize < r->block_sizes[j]; oldsize++) {
+		    if ((unsigned char)r->blocks[j][oldsize] != TAG(j, r->thread)) {
+			r->msg = "Payload overwritten while allocated in a thread";
+			return NULL;
+		    }
+		}
+		r->block_regions[j] = -1;
+	    }
+	    if (r->regions[region] != NULL)
+		mm_region_reset(r->regions[region]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    for (region = 0; region < MAX_REGIONS; region++)
+	if (r->regions[region] != NULL)
+	    mm_region_destroy(r->regions[region]);
+    return NULL;
+}
+
+/*
+ * handoff_push - Hand block p to thread to free, without a lock
+ */
+static void handoff_push(int thread, void *p)
+{
+    void *head = __atomic_load_n(&handoff[thread], __ATOMIC_RELAXED);
+
+    do {
+	*(void **)p = head;
+    } while (!__atomic_compare_exchange_n(&handoff[thread], &head, p, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * handoff_drain - Free the blocks handed to thread so far
+ */
+static void handoff_drain(int thread)
+{
+    void *p, *next;
+
+    if (__atomic_load_n(&handoff[thread], __ATOMIC_RELAXED) == NULL)
+	return;
+    p = __atomic_exchange_n(&handoff[thread], NULL, __ATOMIC_ACQUIRE);
+    for (; p != NULL; p = next) {
+	next = *(void **)p;
+	mm_free(p);
+    }
 }
 
 /*
@@ -833,13 +1529,15 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, j, newsize;
     char *p, *newp, *oldp;
 
+    memset(trace->block_regions, -1, trace->num_ids * sizeof(int));
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
+        case HINT: /* malloc, which takes no hint */
 	    if ((p = malloc(trace->ops[i].size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
@@ -847,6 +1545,23 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -861,11 +1576,48 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
+        case BATCH: /* one malloc per block */
+	    for (j = 0; j < trace->ops[i].count; j++) {
+		if ((p = malloc(trace->ops[i].size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		trace->blocks[trace->ops[i].index + j] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    for (j = 0; j < trace->ops[i].count; j++)
+		free(trace->blocks[trace->ops[i].index + j]);
+	    break;
+
+        case REGION_ALLOC: /* malloc, freed with the region */
+	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    trace->block_regions[trace->ops[i].index] = trace->ops[i].region;
+	    break;
+
+        case REGION_RESET: /* free every block of the region */
+	    for (j = 0; j < trace->num_ids; j++) {
+		if (trace->block_regions[j] == trace->ops[i].region) {
+		    free(trace->blocks[j]);
+		    trace->block_regions[j] = -1;
+		}
+	    }
+	    break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
     }
 
+    for (j = 0; j < trace->num_ids; j++)
+	if (trace->block_regions[j] != -1)
+	    free(trace->blocks[j]);
+
     return 1;
 }
 
@@ -876,14 +1628,16 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
+    memset(trace->block_regions, -1, trace->num_ids * sizeof(int));
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case HINT: /* malloc, which takes no hint */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 	    if ((p = malloc(size)) == NULL)
@@ -891,6 +1645,22 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = calloc(1, size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -906,8 +1676,42 @@ static void eval_libc_speed(void *ptr)
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case BATCH: /* one malloc per block */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		if ((trace->blocks[j] = malloc(size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    index = trace->ops[i].index;
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		free(trace->blocks[j]);
+	    break;
+
+        case REGION_ALLOC: /* malloc, freed with the region */
+	    index = trace->ops[i].index;
+	    if ((trace->blocks[index] = malloc(trace->ops[i].size)) == NULL)
+		unix_error("malloc failed in eval_libc_speed");
+	    trace->block_regions[index] = trace->ops[i].region;
+	    break;
+
+        case REGION_RESET: /* free every block of the region */
+	    for (j = 0; j < trace->num_ids; j++) {
+		if (trace->block_regions[j] == trace->ops[i].region) {
+		    free(trace->blocks[j]);
+		    trace->block_regions[j] = -1;
+		}
+	    }
+	    break;
 	}
     }
+
+    for (j = 0; j < trace->num_ids; j++)
+	if (trace->block_regions[j] != -1)
+	    free(trace->blocks[j]);
 }
 
 /*************************************
@@ -926,17 +1730,19 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "heapKB", "peakKB");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%8.0f%8.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].heap/1024,
+		   stats[i].peak/1024);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -1004,14 +1810,17 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-M <MB>] [-T <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-M <MB>    Limit the heap to <MB> megabytes.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace in <n> threads at once,\n");
+    fprintf(stderr, "\t           and time that (thread-safe builds only).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -2,7 +2,12 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The heap is a range of address space reserved up front, whose
+ *            pages are only committed (made accessible) as the brk pointer
+ *            advances over them, and decommitted when it moves back.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,20 +23,62 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit;     /* points past the last committed heap byte */
+static char *mem_dirty;      /* heap bytes at or past this still read as zero */
+static size_t mem_peak;      /* largest heap plus regions since the last reset */
+
+/* regions mapped outside the heap */
+typedef struct {
+    char *lo;                /* first byte of the region */
+    size_t size;             /* size of the region in bytes */
+} region_t;
+
+static region_t *mem_regions;   /* the regions, in no particular order */
+static int mem_nregions;        /* number of regions */
+static int mem_maxregions;      /* number of regions there is room for */
+static size_t mem_mapped;       /* total size of the regions in bytes */
+
+/* pages are committed and decommitted this many bytes at a time */
+#define COMMIT_CHUNK (1<<16)
+
+/* shrinking the heap keeps this many bytes past brk committed */
+#define DECOMMIT_KEEP (1<<20)
+
+/* heaps limited to at least this many bytes ask for transparent huge pages */
+#define HUGEPAGE_HEAP (64*(1<<20))
+
+/* Round address p up to a multiple of COMMIT_CHUNK */
+#define COMMIT_ROUND(p) \
+    ((char *)(((size_t)(p) + COMMIT_CHUNK - 1) & ~(size_t)(COMMIT_CHUNK - 1)))
+
+static void mem_decommit(char *lo);
+static void mem_update_peak(void);
+static region_t *mem_find_region(void *p);
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model with a heap of at most
+ *    max_heap bytes
  */
-void mem_init(void)
+void mem_init(size_t max_heap)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM */
+    max_heap = (size_t)COMMIT_ROUND(max_heap);
+    mem_start_brk = mmap(NULL, max_heap, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+#ifdef MADV_HUGEPAGE
+    if (max_heap >= HUGEPAGE_HEAP)
+	madvise(mem_start_brk, max_heap, MADV_HUGEPAGE);
+#endif
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_max_addr = mem_start_brk + max_heap;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_commit = mem_start_brk;               /* and nothing is committed */
+    mem_dirty = mem_start_brk;                /* or written */
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +86,156 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    free(mem_regions);
+    munmap(mem_start_brk, mem_max_addr - mem_start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap all regions. The heap stays committed, so that a trace run
+ *    over and over does not pay for page faults every time.
  */
 void mem_reset_brk()
 {
+    while (mem_nregions > 0)
+	mem_unmap(mem_regions[0].lo);
     mem_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk; mem_trim does that.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+    if (incr < 0) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Negative increment...\n");
 	return (void *)-1;
     }
+    if ((mem_brk + incr) > mem_max_addr) {
+	errno = ENOMEM;		/* callers may fall back on mem_map */
+	return (void *)-1;
+    }
+    if (mem_brk + incr > mem_commit) {
+	char *commit = COMMIT_ROUND(mem_brk + incr);
+	if (mprotect(mem_commit, commit - mem_commit, 
+		     PROT_READ | PROT_WRITE) < 0) {
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	mem_commit = commit;
+    }
     mem_brk += incr;
+    if (mem_brk > mem_dirty)
+	mem_dirty = mem_brk;
+    mem_update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_trim - shrink the heap by decr bytes, but never below its first
+ *    byte, and decommit the chunks more than DECOMMIT_KEEP bytes past the
+ *    new brk. Returns the new brk, or (void *)-1 if decr is too large.
+ */
+void *mem_trim(size_t decr)
+{
+    if (decr > (size_t)(mem_brk - mem_start_brk)) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_trim failed. Shrinking past the heap start...\n");
+	return (void *)-1;
+    }
+    mem_brk -= decr;
+    if (mem_commit - mem_brk > DECOMMIT_KEEP)
+	mem_decommit(mem_brk + DECOMMIT_KEEP);
+    return (void *)mem_brk;
+}
+
+/*
+ * mem_map - map a region of size bytes outside the heap, and return
+ *    its (page-aligned) start address, or NULL if that fails.
+ */
+void *mem_map(size_t size)
+{
+    char *lo;
+
+    if (mem_nregions == mem_maxregions) {
+	int max = mem_maxregions ? 2*mem_maxregions : 16;
+	region_t *regions = realloc(mem_regions, max * sizeof(region_t));
+	if (regions == NULL)
+	    return NULL;
+	mem_regions = regions;
+	mem_maxregions = max;
+    }
+
+    lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED)
+	return NULL;
+
+    mem_regions[mem_nregions].lo = lo;
+    mem_regions[mem_nregions].size = size;
+    mem_nregions++;
+    mem_mapped += size;
+    mem_update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_unmap - unmap the region starting at p
+ */
+void mem_unmap(void *p)
+{
+    region_t *r = mem_find_region(p);
+
+    assert(r != NULL);
+    munmap(r->lo, r->size);
+    mem_mapped -= r->size;
+    *r = mem_regions[--mem_nregions];
+}
+
+/*
+ * mem_remap - resize the region starting at p to size bytes, moving it
+ *    if need be. Returns the new start address, or NULL (leaving the
+ *    region alone) if that fails.
+ */
+void *mem_remap(void *p, size_t size)
+{
+    region_t *r = mem_find_region(p);
+    char *lo;
+
+    assert(r != NULL);
+    lo = mremap(r->lo, r->size, size, MREMAP_MAYMOVE);
+    if (lo == MAP_FAILED)
+	return NULL;
+
+    mem_mapped += size - r->size;
+    r->lo = lo;
+    r->size = size;
+    mem_update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_in_region - return whether the bytes lo..hi lie in a single region
+ */
+int mem_in_region(void *lo, void *hi)
+{
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	if ((char *)lo >= mem_regions[i].lo &&
+	    (char *)hi < mem_regions[i].lo + mem_regions[i].size)
+	    return 1;
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +252,16 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_clean - return the address from which the heap reads as zero:
+ *    bytes there and above have not been handed out by mem_sbrk since
+ *    they were last committed
+ */
+void *mem_heap_clean()
+{
+    return (void *)mem_dirty;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,6 +270,23 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_mapsize() - returns the total size of the regions in bytes
+ */
+size_t mem_mapsize() 
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peakheapsize() - returns the largest heap size in bytes since the
+ *    last reset, counting the regions
+ */
+size_t mem_peakheapsize() 
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -99,3 +294,43 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_decommit - give back the committed chunks that lie wholly at or
+ *    above lo, so that they read as zeros when committed again
+ */
+static void mem_decommit(char *lo)
+{
+    lo = COMMIT_ROUND(lo);
+    if (lo >= mem_commit)
+	return;
+    madvise(lo, mem_commit - lo, MADV_DONTNEED);
+    mprotect(lo, mem_commit - lo, PROT_NONE);
+    mem_commit = lo;
+    if (mem_dirty > lo)
+	mem_dirty = lo;
+}
+
+/*
+ * mem_update_peak - account for the current heap and regions in the peak
+ */
+static void mem_update_peak(void)
+{
+    size_t size = mem_heapsize() + mem_mapped;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/*
+ * mem_find_region - return the region starting at p, or NULL
+ */
+static region_t *mem_find_region(void *p)
+{
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	if (mem_regions[i].lo == (char *)p)
+	    return &mem_regions[i];
+    return NULL;
+}
@@ -1,11 +1,19 @@
 #include <unistd.h>
 
-void mem_init(void);               
+void mem_init(size_t max_heap);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_trim(size_t decr);
+void *mem_map(size_t size);
+void mem_unmap(void *p);
+void *mem_remap(void *p, size_t size);
+int mem_in_region(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_clean(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peakheapsize(void);
 size_t mem_pagesize(void);
 
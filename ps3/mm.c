@@ -1,15 +1,23 @@
 /*
  * mm.c - a custom implementation of malloc.
  * * Allocated/Free Block Structure *
- * Each block has a header with the size and is allocated bit.
- * Each block has a footer with the size and is allocated bit.
+ * Each block has a header with the size, is allocated bit, and a bit saying
+ * whether the previous block is allocated.
+ * Only free blocks have a footer with the size, since the footer is only read
+ * when coalescing with a free previous block.
  * Each free block has a prev pointer and next pointer as the first
- * two words after the header.
+ * two words after the header. Free list pointers are stored as signed 32-bit
+ * offsets from heap_listp, so the minimum block is 16 bytes on both 32-bit
+ * and 64-bit machines.
  *
  * *Free List Structure*
  * Free blocks are maintained in a segregated free list, with exact sizes for
- * up to 512 and then the next buckets double in size each time. Each bucket keeps
- * free blocks in a linked list.
+ * up to 512 and then the next buckets double in size each time. Each exact
+ * bucket keeps free blocks in a linked list. Each doubling bucket keeps them
+ * in a splay tree ordered by size, with the left and right child pointers as
+ * the third and fourth words after the header. Blocks of the same size hang
+ * off their tree node in a linked list, so every tree node has a distinct size
+ * and only tree nodes have a NULL prev pointer.
  * 
  * *Manipulating the free list structure*
  * When allocating, the allocator looks in the correct bucket for a fit. If
@@ -19,10 +27,120 @@
  *
  * When freeing, the allocator adds the block to the appropriate bucket's linked
  * list after coalescing with the surrounding blocks.
+ *
+ * *Deferred coalescing*
+ * With DEFER_COALESCE, freed blocks in the first QUICK_LISTS exact buckets go
+ * on a LIFO quick list instead, still marked allocated so that nothing merges
+ * with them. mm_malloc takes blocks of those sizes straight off the quick
+ * lists. A quick list is coalesced into the free lists once it gets
+ * QUICK_THRESHOLD blocks long, and all of them are when find_fit fails, or
+ * when a free makes a free block of QUICK_BYTES bytes, ends the heap, or
+ * frees the last live block, so that blocks waiting at the end of the heap
+ * don't keep it from being trimmed.
+ * When a request finds both its quick list and its exact bucket empty, a free
+ * block is carved into several blocks of that size at once, and the spare ones
+ * go on the quick list. The count starts at REFILL_MIN, doubles with each
+ * refill up to REFILL_MAX, and halves whenever the list is coalesced.
+ * 
+ * *Segments*
+ * The heap is made of segments, each with its own prologue and epilogue, so
+ * coalescing and heap walks never cross from one into the next. The first
+ * segment is the one mem_sbrk grows. Once it can't grow any further,
+ * extend_heap maps a new segment with mem_map, of at least SEG_SIZE bytes and
+ * a SEG_GROWTH-th of the heap so far, up to MAX_BLOCK bytes, so the segments
+ * grow geometrically.
+ * Segments must lie within OFFSET_SPAN bytes of heap_listp.
+ * 
+ * *Huge blocks*
+ * Requests of at least MMAP_THRESHOLD bytes get a region of their own from
+ * mem_map, with the header in the last word before the first aligned payload
+ * address. The header holds the region size, in units of MAP_SCALE bytes so
+ * that regions may outgrow 4 GB, and the MAPPED bit, so mm_free unmaps the
+ * region directly and mm_realloc resizes it with mem_remap.
+ * 
+ * *Trimming*
+ * When mm_free leaves a free block of at least TRIM_THRESHOLD bytes at the end
+ * of the heap, the heap is shrunk so that only TRIM_KEEP bytes of it remain.
+ * The gap between the two keeps a heap that hovers around its end from being
+ * trimmed and grown over and over.
+ * 
+ * *Slabs*
+ * Requests of up to SLAB_MAX bytes never get a block of their own. Each size
+ * class carves page-sized runs, which are ordinary allocated blocks aligned to
+ * RUN_SIZE, into header-less slots, and tracks them with a bitmap in the run
+ * header. A bitmap with one bit per RUN_SIZE page of the heap says which pages
+ * are runs, so mm_free can tell slots apart from blocks by address alone.
+ * 
+ * *Threads*
+ * Built with -DTHREAD_SAFE=1 (and -pthread), the heap is split into NUM_ARENAS
+ * arenas, each with its own lock, and the mm_ functions lock an arena around
+ * the heap_ functions that do the work. Only the first arena grows with
+ * mem_sbrk; the others are made of mapped segments, so a block's arena is
+ * found from its address. A request the thread's own arena is out of memory
+ * for is retried in each of the others. Each thread keeps a cache of free
+ * slots and small blocks, by size class, that it allocates from and frees into
+ * without a lock. An empty cache class is refilled, and a full one drained,
+ * TCACHE_BATCH blocks at a time under one lock. Cached blocks stay marked
+ * allocated. mm_init bumps a generation number that makes every thread drop
+ * its cache, since the blocks in it are gone. Blocks freed by a thread other
+ * than the owner go onto a lock-free stack that the owner empties the next
+ * time it allocates.
+ * With -DLOCKFREE=1 the quick lists are lock-free stacks with tagged heads
+ * instead, which threads pop and push without a lock and without going
+ * through their cache. Only coalescing and the larger buckets take the arena
+ * lock, and the heap is never trimmed.
+ * 
+ * *Lifetimes*
+ * Blocks placed from a free block go to its bottom if they are expected to
+ * live long and to its top if not, so that the short-lived ones die next to
+ * each other and coalesce into large blocks. mm_malloc_hint takes the
+ * expectation from the caller. Otherwise each size class learns it: one
+ * allocation in LIFE_SAMPLE is timed in allocations until it is freed, and a
+ * block that dies before as many allocations as there are live blocks, the
+ * mean lifetime, votes its class short-lived. The votes outlive mm_init, as
+ * they describe the program rather than the heap.
+ * Classes with no lifetime to go by are placed by size instead: large blocks
+ * at the top of a free block and small ones at its bottom, so that they do
+ * not interleave, split by the running median of the sizes placed. The free
+ * block at the end of the heap is left to grow at its bottom.
  * 
  * *Realloc*
  * Realloc uses several heuristics (using the same block if we're reallocating to
- * less, and combining with the next adjacent block if possible).
+ * less, and combining with the adjacent blocks if possible). A small table
+ * hashed by address counts how often each recently reallocated block grew;
+ * once a block has grown GROW_AFTER times it gets GROW_NUM/GROW_DEN of its
+ * size (at most GROW_CAP) as slack, so that the following reallocs fit in
+ * place, and keeps that slack when it fits or shrinks.
+ *
+ * *Calloc*
+ * A free block whose payload is known to read as zero, apart from its links
+ * (the first four words) and its footer, has the ZEROED bit, which shares its
+ * place with MAPPED as only allocated blocks can be MAPPED. Heap extensions
+ * that mem_heap_clean says were never written and new segments are ZEROED,
+ * splitting a block keeps the bit on both parts, and coalescing keeps it only
+ * if every part has it, clearing the boundary tags and links in between.
+ * mm_calloc clears just the links and footer of a ZEROED block, and all of
+ * any other. Huge blocks are fresh regions, so they are zero already.
+ *
+ * *Sizes*
+ * mm_malloc_usable_size reports the whole payload, including any slack the
+ * block got, such as a remainder too small for place to split off. A size
+ * given to mm_free_sized that is too large for a slot says the block is not
+ * one, so the run bitmap is skipped.
+ *
+ * *Batches*
+ * mm_malloc_batch carves up to BATCH_BYTES worth of blocks at a time out of
+ * one free block, which leaves its list once for all of them. mm_free_batch
+ * sorts the blocks by address, and frees each run of blocks that follow one
+ * another in the heap as a single block, so it is coalesced only once.
+ *
+ * *Regions*
+ * A region hands out objects by bumping a pointer through chunks it gets with
+ * mm_malloc, each chunk twice the size of the last up to REGION_CHUNK_MAX.
+ * An object too large for a chunk gets one of its own. Objects are never
+ * freed one by one: mm_region_reset keeps the current chunk and frees all
+ * the others with one mm_free_batch, listing them in the kept chunk. A region
+ * belongs to one thread at a time.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,10 +148,31 @@
 #include <limits.h>
 #include <unistd.h>
 #include <string.h>
-#include <math.h>
+#include <stdint.h>
 #include "mm.h"
 #include "memlib.h"
 
+/* thread-safe build, with -DTHREAD_SAFE=1 -pthread, and its lock-free engine,
+   with -DLOCKFREE=1 -pthread */
+#ifndef LOCKFREE
+#define LOCKFREE 0
+#endif
+#ifndef THREAD_SAFE
+#define THREAD_SAFE LOCKFREE
+#endif
+#if LOCKFREE && !THREAD_SAFE
+#error "LOCKFREE needs THREAD_SAFE"
+#endif
+#if THREAD_SAFE
+#include <pthread.h>
+#endif
+
+/* debug build that checks the sizes passed to mm_free_sized, with
+   -DCHECK_SIZED=1 */
+#ifndef CHECK_SIZED
+#define CHECK_SIZED 0
+#endif
+
 // metadata
 team_t team = {
     /* Team name */
@@ -48,11 +187,13 @@ team_t team = {
     ""
 };
 
-/* single word (4) or double word (8) alignment */
+/* double word (8) or quad word (16) alignment; build with -DALIGNMENT=16 */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
@@ -61,450 +202,2624 @@ team_t team = {
 #define DSIZE       8       /* Double word size (bytes) */
 #define CHUNKSIZE  (1<<8)  /* Extend heap by this amount (bytes) */
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
-/* Pack a size and allocated bit into a word */
+/* Pack a size and allocated bits into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
+#define PREV_ALLOC  0x2     /* Previous block is allocated */
+#define MAPPED      0x4     /* Allocated block is a region of its own */
+#define ZEROED      0x4     /* Free block reads as zero but for links and footer */
 
 /* Read and write a word at address p */
 #define GET(p)           (*(unsigned int *)(p))
 #define PUT(p, val)      (*(unsigned int *)(p) = (val))
-#define PUT_ADDR(p, val) (*(void **)(p) = (val))
+
+/* Read and write a pointer at address p, stored as a word holding its signed
+   offset from arena->heap_listp in units of DSIZE. arena->heap_listp itself is never a free
+   block, so offset 0 stands for NULL. */
+#define GET_PTR(p)      (GET(p) ? (void *)(arena->heap_listp + (long)(int)GET(p)*DSIZE) : NULL)
+#define PUT_PTR(p, val) PUT(p, (val) ? \
+                            (unsigned int)(((char *)(val) - arena->heap_listp) / DSIZE) : 0)
+
+/* Offsets reach this many bytes either way from heap_listp */
+#define OFFSET_SPAN ((1UL<<31) * DSIZE)
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_MAPPED(p) (GET(p) & MAPPED)
+#define GET_ZEROED(p) (GET(p) & ZEROED)
+
+/* Read the region size from the header at address p of a huge block, which
+   holds it divided by MAP_SCALE, and pack a region size with its bits */
+#define GET_MAP_SIZE(p)   ((size_t)GET_SIZE(p) * MAP_SCALE)
+#define PACK_MAP(msize)   PACK((unsigned int)((msize) / MAP_SCALE), 1 | MAPPED)
 
-/* Given block ptr bp, compute address of its header and footer */
+/* Set or clear the previous-allocated bit in the header of block bp */
+#define SET_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
+
+/* Block size for a request of size bytes: payload plus header, aligned, and
+   big enough to hold the links and footer once the block is freed */
+#define ADJUST_SIZE(size) ((size) <= 2*DSIZE - WSIZE ? 2*DSIZE : ALIGN((size) + WSIZE))
+
+/* Heap blocks stay below MAX_BLOCK bytes, so their sizes fit in a header.
+   Larger requests are mapped or fail, before ADJUST_SIZE can wrap around. */
+#define MAX_BLOCK   (1UL<<31)
+#define MAX_REQUEST (MAX_BLOCK - (1<<16))
+
+/* Given block ptr bp, compute address of its header and footer (free only) */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)
-#define PRVP(bp)       ((void **)(bp))
-#define NXTP(bp)       ((void **)(bp) + 1)
+#define PRVP(bp)       ((char *)(bp))
+#define NXTP(bp)       ((char *)(bp) + WSIZE)
+#define LFTP(bp)       ((char *)(bp) + 2*WSIZE)
+#define RGTP(bp)       ((char *)(bp) + 3*WSIZE)
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous (free only) blocks */
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
-/* number of free lists */
+/* number of free lists, and the number of words in the non-empty bitmap */
 #define NUM_FREE_LISTS 128
+#define NUM_MAP_WORDS  (NUM_FREE_LISTS / 32)
+
+/* sizes below this have exact-size lists; the rest live in size-ordered trees */
+#define EXACT_LIMIT 512
+#define TREE_INDEX  (get_index(EXACT_LIMIT))
+
+/* deferred coalescing, on unless built with -DDEFER_COALESCE=0 */
+#ifndef DEFER_COALESCE
+#define DEFER_COALESCE 1
+#endif
+#define QUICK_LISTS     45  /* exact buckets that get a quick list */
+#define QUICK_THRESHOLD 64  /* a quick list this long gets coalesced */
+#define QUICK_BYTES (1<<16) /* all are once a free block this large is made */
+#define REFILL_MIN      2   /* blocks carved to refill an empty bucket, at first */
+#define REFILL_MAX      16  /* and at most */
+#if LOCKFREE && !DEFER_COALESCE
+#error "LOCKFREE needs DEFER_COALESCE"
+#endif
+
+/* tagged quick list heads of the lock-free engine: the offset of the first
+   block, as GET_PTR reads it, and a count of pops in the upper half */
+#define HEAD_OFF(h)     ((unsigned int)(h))
+#define HEAD_TAG(h)     ((h) >> 32)
+#define PACK_HEAD(o, t) (((unsigned long long)(t) << 32) | (unsigned int)(o))
+
+/* heap segments after the first are mapped at least SEG_SIZE bytes large,
+   and at least a SEG_GROWTH-th of the arena's heap so far, up to MAX_BLOCK */
+#define SEG_SIZE     (1<<20)
+#define SEG_GROWTH   4
+#define MAX_SEGMENTS 64
+
+/* requests this large get a region of their own */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1<<17)
+#endif
+
+/* mm_calloc just clears smaller requests, as they come from the slabs, caches
+   and quick lists, whose blocks are never known to be zero */
+#define ZERO_MIN ((QUICK_LISTS + 1) * 8)
+
+/* regions are whole pages, so a header can hold their size in units of
+   MAP_SCALE bytes and keep its low bits; requests above MAP_MAX would not fit */
+#define MAP_SCALE 512
+#define MAP_MAX   (1UL<<40)
+
+/* Size of the region for a huge request of at most MAP_MAX bytes */
+#define MAP_SIZE(size) \
+    (((size) + ALIGNMENT + mem_pagesize() - 1) & ~(mem_pagesize() - 1))
+
+/* trim a trailing free block this large down to TRIM_KEEP bytes */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1<<16)
+#endif
+#define TRIM_KEEP      (1<<12)
+
+/* slab size classes, and the size and alignment of the runs they carve */
+#define SLAB_MAX          16
+#define NUM_SLAB_CLASSES  (SLAB_MAX / ALIGNMENT)
+#define RUN_SIZE          (1<<12)
+#define RUN_MAP_WORDS     (RUN_SIZE / ALIGNMENT / 32)
+
+/* the run bitmap covers this many bytes from the start of the heap */
+#define RUN_SPAN          (1UL<<32)
+
+/* Given slot ptr p, compute address of the run it belongs to */
+#define RUNP(p) ((run_t *)((uintptr_t)(p) & ~(uintptr_t)(RUN_SIZE-1)))
+
+/* realloc growth prediction: slack is GROW_NUM/GROW_DEN of the size, capped
+   at GROW_CAP bytes, once a block has grown GROW_AFTER times */
+#define GROW_AFTER  2
+#define GROW_NUM    1
+#define GROW_DEN    2
+#define GROW_CAP    (1<<16)
+#define GROW_SLOTS  64       /* entries in the growth table */
+
+/* mm_malloc_batch carves at most this many bytes of blocks at a time */
+#define BATCH_BYTES (1<<16)
+
+/* regions carve objects out of chunks of REGION_CHUNK bytes at first, twice as
+   large with each chunk up to REGION_CHUNK_MAX; a chunk starts with a link */
+#define REGION_CHUNK     (1<<12)
+#define REGION_CHUNK_MAX (1<<16)
+#define CHUNK_HDR_SIZE   ALIGN(sizeof(void *))
+
+/* lifetime learning: one allocation in LIFE_SAMPLE is timed, in a table of
+   LIFE_SLOTS, and each size class keeps a vote between -LIFE_MAX and LIFE_MAX
+   on whether its blocks die young */
+#define LIFE_SAMPLE 8
+#define LIFE_SLOTS  256
+#define LIFE_MAX    8
+
+/* a short-lived block that finds no fit grows the heap by at least this much,
+   so that the ones after it gather at the top of the same free block */
+#ifndef LIFE_CHUNK
+#define LIFE_CHUNK (1<<14)
+#endif
+
+/* blocks of at least PLACE_SPLIT bytes are placed at the top of free blocks
+   and smaller ones at the bottom; 0 learns the split from the sizes placed,
+   moving it by a SPLIT_STEP-th towards each */
+#ifndef PLACE_SPLIT
+#define PLACE_SPLIT 0
+#endif
+#define SPLIT_STEP  16
+
+/* Lifetime table slot for block bp */
+#define LIFE_HASH(bp) (((uintptr_t)(bp) / DSIZE) % LIFE_SLOTS)
+
+/* Growth table slot for block bp */
+#define GROW_HASH(bp) (((uintptr_t)(bp) / DSIZE) % GROW_SLOTS)
+
+/* per-thread caches, by size class: one class per slab class, then one per
+   quick list bucket, unless the quick lists are lock-free */
+#define TCACHE_CLASSES (NUM_SLAB_CLASSES + (LOCKFREE ? 0 : QUICK_LISTS))
+#define TCACHE_MAX     32  /* a full class gets drained */
+#define TCACHE_BATCH   16  /* blocks refilled or drained at a time */
+
+/* number of arenas, which only the thread-safe build has more than one of */
+#ifndef NUM_ARENAS
+#define NUM_ARENAS (THREAD_SAFE ? 4 : 1)
+#endif
+
+/* Lock this thread's arena, the i-th arena after it, or the arena that owns
+   p, making it the current arena, and unlock the current arena */
+#if THREAD_SAFE
+#define ENTER_OWN()    lock_own_arena()
+#define ENTER_NEXT(i)  lock_next_arena(i)
+#define ENTER_OWNER(p) lock_owner(p)
+#define LEAVE()        pthread_mutex_unlock(&arena->lock)
+#else
+#define ENTER_OWN()    ((void)0)
+#define ENTER_NEXT(i)  ((void)0)
+#define ENTER_OWNER(p) ((void)0)
+#define LEAVE()        ((void)0)
+#endif
+
+/* A thread's cache of free blocks, each linked through its first word */
+typedef struct {
+    void *list[TCACHE_CLASSES];    /* first cached block of each class */
+    int count[TCACHE_CLASSES];     /* number of cached blocks in each class */
+    unsigned long gen;             /* heap generation the blocks belong to */
+    int registered;                /* whether the thread exit hook is set */
+} tcache_t;
+
+/* Header at the start of every run */
+typedef struct run_t {
+    struct run_t *prev;            /* prev run with free slots in the class */
+    struct run_t *next;            /* next run with free slots in the class */
+    unsigned int slot_size;        /* bytes per slot */
+    unsigned int nslots;           /* number of slots */
+    unsigned int nfree;            /* number of free slots */
+    unsigned int map[RUN_MAP_WORDS]; /* bit set iff slot is in use */
+} run_t;
+
+/* Offset of the first slot in a run */
+#define RUN_HDR_SIZE ((sizeof(run_t) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
+
+/* A region: objects bumped out of chunks that are all freed together */
+struct mm_region {
+    char *cur;                     /* next free byte of the current chunk */
+    char *end;                     /* end of the current chunk */
+    void *chunks;                  /* current chunk, then the older ones */
+    size_t chunk_size;             /* size of the next chunk */
+};
+
+/* An arena: a heap with its own segments, free lists and lock */
+typedef struct {
+    char *heap_listp;                     /* Pointer to first block */
+    char *seg_listp[MAX_SEGMENTS];        /* First block of each segment */
+    char *seg_end[MAX_SEGMENTS];          /* End of each mapped segment */
+    int num_segs;                         /* Number of segments */
+    void *freelistp[NUM_FREE_LISTS];      /* First free blocks, or tree roots */
+    unsigned int freemap[NUM_MAP_WORDS];  /* Bit i set iff list i non-empty */
+#if LOCKFREE
+    unsigned long long quickhead[QUICK_LISTS]; /* Tagged quick list heads */
+#else
+    void *quicklistp[QUICK_LISTS];        /* Freed blocks waiting to coalesce */
+    unsigned long long quickmap;          /* Bit i set iff quick list i non-empty */
+#endif
+    int quickcnt[QUICK_LISTS];            /* Number of blocks in each quick list */
+    int refill_k[QUICK_LISTS];            /* Blocks carved by the next refill */
+    run_t *slab_runs[NUM_SLAB_CLASSES];   /* Runs with free slots, by class */
+    size_t runmap_words;                  /* Number of runmap words it set bits in */
+    void *grow_bp[GROW_SLOTS];            /* Recently grown blocks, by GROW_HASH */
+    int grow_cnt[GROW_SLOTS];             /* How many times each of them grew */
+    unsigned long tick;                   /* Allocations so far, the lifetime clock */
+    unsigned long live;                   /* Blocks allocated and not freed yet */
+    void *life_bp[LIFE_SLOTS];            /* Sampled blocks, by LIFE_HASH */
+    unsigned long life_at[LIFE_SLOTS];    /* Tick each of them was allocated at */
+    signed char life_cls[LIFE_SLOTS];     /* And its size class */
+    signed char life_vote[NUM_FREE_LISTS]; /* > 0 iff the class dies young */
+    size_t split;                         /* Running median of the sizes placed */
+#if THREAD_SAFE
+    pthread_mutex_t lock;                 /* Guards all of the above */
+    void *remote_free;                    /* Blocks other threads freed, unlocked */
+#endif
+} arena_t;
+
+/* End of segment s of the current arena */
+#define SEG_END(s) (arena == &arenas[0] && (s) == 0 ? \
+                    (char *)mem_heap_hi() + 1 : arena->seg_end[s])
+
+/* Memory system calls, which all arenas share, go through this lock */
+#if THREAD_SAFE
+#define MEM_LOCK()   pthread_mutex_lock(&mem_lock)
+#define MEM_UNLOCK() pthread_mutex_unlock(&mem_lock)
+#else
+#define MEM_LOCK()   ((void)0)
+#define MEM_UNLOCK() ((void)0)
+#endif
 
 /* Global variables */
-static char *heap_listp = 0;  /* Pointer to first block */
-static void *freelistp[NUM_FREE_LISTS]; /* Pointer to first free blocks */
+static arena_t arenas[NUM_ARENAS]; /* The arenas; the first one owns the mem_sbrk heap */
+static unsigned int runmap[RUN_SPAN / RUN_SIZE / 32]; /* Bit set iff page is a run */
+static char *run_base; /* Page that the run bitmap counts pages from */
+#if THREAD_SAFE
+static __thread arena_t *arena; /* Arena this thread is working on */
+static __thread arena_t *own_arena; /* Arena this thread allocates from */
+static unsigned int next_arena; /* Arena the next new thread starts out with */
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards memlib */
+static unsigned long heap_gen = 1; /* Bumped by mm_init to empty the caches */
+static pthread_key_t tcache_key; /* Drains a thread's cache when it exits */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache; /* This thread's cache */
+#else
+#define arena (&arenas[0])
+#endif
 
 /* Function prototypes for internal helper routines */
+static int heap_init(void);
+static void *heap_malloc(size_t size);
+static void *heap_malloc_hint(size_t size, int hint);
+static void *heap_alloc(size_t size, int hint);
+static void life_alloc(void *bp, size_t size);
+static void life_free(void *bp);
+static void life_vote(int index, int young);
+static int short_lived(int index, int hint);
+static int place_large(void *bp, size_t asize, int index, int hint);
+static void heap_free(void *ptr);
+static void heap_free_block(void *ptr);
+static void free_ptr(void *ptr, int slot);
+static size_t usable_size(void *bp);
+static void *heap_realloc(void *ptr, size_t size);
+static void *heap_memalign(size_t align, size_t size);
+static void *heap_calloc(size_t size);
+static int heap_malloc_batch(size_t size, int n, void **out);
+static void heap_free_run(void **ptrs, int n);
+static int cmp_addr(const void *a, const void *b);
+static int is_next(void *bp, void *next);
+static void *region_chunk(mm_region_t *r, size_t size, int current);
+#if THREAD_SAFE
+static int tcache_class(size_t size);
+static void tcache_check(void);
+static void *tcache_alloc(size_t size);
+static int tcache_free(void *bp, int slot);
+static void tcache_key_create(void);
+static void tcache_release(void *arg);
+static void tcache_drain(void **listp, int n);
+static void arenas_create(void);
+static arena_t *owner_arena(void *p);
+static void lock_own_arena(void);
+static void lock_next_arena(int i);
+static void lock_owner(void *p);
+static int remote_free(void *bp);
+#if LOCKFREE
+static void *quick_alloc(size_t size);
+static int quick_free(void *bp);
+#endif
+static void remote_push(arena_t *a, void *bp);
+static void remote_drain(void);
+#endif
 static int mm_check();
 static void *extend_heap(size_t words);
+static void *new_segment(size_t size);
+static int in_heap(void *p);
 static void place(void *bp, size_t asize);
+static void *place_high(void *bp, size_t asize);
+static void place_batch(void *bp, size_t asize, int n, void **out);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
+static void zero_seam(void *bp);
+static void *free_block(void *bp);
+static void shrink_block(void *bp, size_t asize);
+static void *quick_pop(int index);
+static int quick_push(void *bp);
+static void quick_flush(int index);
+static int quick_flush_all(void);
+static void *quick_refill(int index, size_t asize);
+static void trim_heap();
+static int can_trim(void);
+static int at_heap_end(void *bp);
+static void consolidate(void *bp);
+static void *map_block(size_t size);
+static void *remap_block(void *bp, size_t size);
 static void add_to_list(void *bp);
 static void remove_from_list(void *bp);
 static int get_index(size_t size);
+static int next_nonempty(int index);
+static void *splay(void *t, size_t size);
+static void tree_insert(void **rootp, void *bp);
+static void tree_remove(void **rootp, void *bp);
+static void *tree_fit(void **rootp, size_t asize);
+static int check_free_block(void *bp, int index);
+static int check_tree(void *t, int index, size_t lo, size_t hi);
+static int in_free_list(void *bp);
+static void *find_aligned(size_t align, size_t asize);
+static int in_run(void *p);
+static void *slab_alloc(size_t size);
+static void slab_free(void *p);
+static int run_pins_heap(run_t *run);
+static void run_release(run_t *run);
+static void trim_runs(void);
+static run_t *run_create(int cls);
+static int check_runs();
+static int check_quick();
 
 /* 
  * mm_init - initialize the malloc package.
  */
 int mm_init(void)
 {
-    // Create the initial empty heap (4 words)
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1) return -1;
-    
-    // Reset freelistp
-    for (int i = 0; i < NUM_FREE_LISTS; i++) freelistp[i] = NULL;
+    size_t words = 0;
+    int ret;
     
-    // Add alignment padding (word 0), prologue (word 1), epilogue (word 3)
-    PUT(heap_listp, 0); /* Alignment padding */
-    PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));
-    PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));
-    PUT(heap_listp + (3*WSIZE), PACK(0, 1));
-    heap_listp += (2*WSIZE);
+#if THREAD_SAFE
+    pthread_once(&arena_once, arenas_create);
+    for (int i = 0; i < NUM_ARENAS; i++) pthread_mutex_lock(&arenas[i].lock);
+    __atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
+#endif
 
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL) return -1;
-    return 0;
+    // Forget all runs and segments; the other arenas start over when first used
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        words = MAX(words, arenas[i].runmap_words);
+        arenas[i].runmap_words = 0;
+        arenas[i].heap_listp = 0;
+        arenas[i].num_segs = 0;
+#if THREAD_SAFE
+        arenas[i].remote_free = NULL;
+#endif
+    }
+    memset(runmap, 0, words * sizeof(runmap[0]));
+
+    // Runs can be made from the pages after the start of the heap, or, with
+    // several arenas, from segments mapped on either side of it
+    run_base = (char *)RUNP(mem_heap_lo());
+    if (NUM_ARENAS > 1 && (uintptr_t)run_base >= RUN_SPAN/2) run_base -= RUN_SPAN/2;
+
+#if THREAD_SAFE
+    arena = &arenas[0];
+#endif
+    ret = heap_init();
+    
+#if THREAD_SAFE
+    for (int i = NUM_ARENAS - 1; i >= 0; i--) pthread_mutex_unlock(&arenas[i].lock);
+#endif
+    return ret;
 }
 
 /* 
- * mm_malloc - Allocate a block.
- * Always allocate a block whose size is a multiple of the alignment.
- * If we find a suitable free block we use it. Otherwise we extend the heap.
+ * mm_malloc - Allocate a block, placed by the lifetime learned for its size.
  */
 void *mm_malloc(size_t size)
-{    
-    // Ignore spurious requests
-    if (size == 0) return NULL;
-    
-    // If still at the start, initialize the heap
-    if (heap_listp == 0) {
-        mm_init();
-    }
-    
-    // Adjust block size to include overhead and alignment reqs.
-    size_t asize;
-    if (size <= DSIZE) asize = 2*DSIZE;
-    else asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
-
-    // Search the free list for a fit
-    char *bp;
-    if ((bp = find_fit(asize)) != NULL) {
-        place(bp, asize);
-        
-        // check heap consistency
-        //if (mm_check()) exit(1);
+{
+    return mm_malloc_hint(size, MM_AUTO);
+}
 
-        return bp;
-    }
+/*
+ * mm_malloc_hint - Allocate a block, from this thread's cache if it can,
+ * placing it with the blocks of the lifetime given by hint: MM_SHORT_LIVED,
+ * MM_LONG_LIVED, or MM_AUTO to go by its size class.
+ */
+void *mm_malloc_hint(size_t size, int hint)
+{
+    void *bp;
 
-    // No fit found. Get more memory and place the block
-    size_t extendsize = MAX(asize,CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL) return NULL;
-    place(bp, asize);
-    
-    // check heap consistency
-    //if (mm_check()) exit(1);
+#if THREAD_SAFE
+    if (size != 0 && (bp = tcache_alloc(size)) != NULL) return bp;
+#endif
+#if LOCKFREE
+    if (size != 0 && (bp = quick_alloc(size)) != NULL) return bp;
+#endif
+    ENTER_OWN();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    bp = heap_malloc_hint(size, hint);
+    LEAVE();
     
+    // Out of memory in this arena? Another one may still have some
+    for (int i = 1; bp == NULL && size != 0 && i < NUM_ARENAS; i++) {
+        ENTER_NEXT(i);
+        bp = heap_malloc_hint(size, hint);
+        LEAVE();
+    }
     return bp;
 }
 
 /*
- * mm_free - Free a block. Coalesce on every free.
+ * mm_free - Free a block, into this thread's cache if it can, or onto the
+ * remote free stack of the arena that owns it if that is another thread's.
  */
 void mm_free(void *ptr)
-{   
-    // don't free a null pointer
-    if(ptr == 0) return;
-    
-    // if still at the start, initialize the heap
-    if (heap_listp == 0) {
-        mm_init();
-    }
+{
+    if (ptr != NULL) free_ptr(ptr, in_run(ptr));
+}
 
-    // mark the block as freed and coalesce
-    size_t size = GET_SIZE(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    add_to_list(ptr);
-    coalesce(ptr);
+/*
+ * mm_free_sized - Free a block allocated for size bytes, or for any size up
+ * to its mm_malloc_usable_size. A block too large to be a slot skips the run
+ * bitmap; built with -DCHECK_SIZED=1, the size is checked against the block.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    if (ptr == NULL) return;
+    if (size <= SLAB_MAX) {
+        mm_free(ptr);
+        return;
+    }
     
-    // check heap consistency
-    //if (mm_check()) exit(1);
+    if (CHECK_SIZED) assert(!in_run(ptr) && size <= usable_size(ptr));
+    free_ptr(ptr, 0);
+}
+
+/*
+ * mm_malloc_usable_size - Return how many bytes the block can hold, which may
+ * be more than were asked for. The caller may use all of them.
+ */
+size_t mm_malloc_usable_size(void *ptr)
+{
+    return ptr == NULL ? 0 : usable_size(ptr);
 }
 
 /*
  * mm_realloc - reallocates a block
- * We use the following heuristics:
- * - using the same block if we're reallocating to less
- * - combining with the next adjacent block if possible.
- * If neither of these works, we just use free and malloc.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
-    //printf("Realloc %p %d\n", ptr, size);
-    
-    size_t oldsize;
     void *newptr;
-
-    /* If size == 0 then this is just free, and we return NULL. */
-    if(size == 0) {
-        mm_free(ptr);
-        return 0;
-    }
-
-    /* If oldptr is NULL, then this is just malloc. */
-    if(ptr == NULL) {
-        return mm_malloc(size);
-    }
     
-    // Adjust block size to include overhead and alignment reqs.
-    size_t asize;
-    if (size <= DSIZE) asize = 2*DSIZE;
-    else asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+    ENTER_OWNER(ptr);
+    newptr = heap_realloc(ptr, size);
+    LEAVE();
     
-    // If the new size is less than the old size, use the same block
-    if ((asize == GET_SIZE(HDRP(ptr)) || asize < GET_SIZE(HDRP(ptr)) - 16) &&
-        GET_SIZE(HDRP(NEXT_BLKP(ptr)))) {
-        int csize = GET_SIZE(HDRP(ptr));
-        
-        // resize the allocated block
-        PUT(HDRP(ptr), PACK(asize, 1));
-        PUT(FTRP(ptr), PACK(asize, 1));
-        
-        if (asize < csize) {
-            void *bp = NEXT_BLKP(ptr);
-
-            // resize the next free block
-            PUT(HDRP(bp), PACK(csize-asize, 0));
-            PUT(FTRP(bp), PACK(csize-asize, 0));
-            add_to_list(bp);
-            coalesce(bp);
-        }
-        newptr = ptr;
-        
-    // If the next adjacent block is large enough and free, use it for the
-    // additional space
-    } else if (
-            ((asize == (GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(NEXT_BLKP(ptr))))) || 
-               (asize + 16 < (GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(NEXT_BLKP(ptr)))))
-            ) &&
-                !GET_ALLOC(HDRP(NEXT_BLKP(ptr))) &&
-                GET_SIZE(HDRP(NEXT_BLKP(ptr)))) {
-        // remove the next free block from the free list
-        void *bp = NEXT_BLKP(ptr);
-        int csize = GET_SIZE(HDRP(ptr)) + GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-        remove_from_list(bp);  
-                
-        // resize the allocated block
-        PUT(HDRP(ptr), PACK(asize, 1));
-        PUT(FTRP(ptr), PACK(asize, 1));
-        
-        bp = NEXT_BLKP(ptr);
-
-        if (asize < csize) {
-            // resize the next free block
-            PUT(HDRP(bp), PACK(csize-asize, 0));
-            PUT(FTRP(bp), PACK(csize-asize, 0));
-            add_to_list(bp);
-            coalesce(bp);
-        }
-        newptr = ptr;
-        
-    // Otherwise, just use malloc and free
-    } else {
-        newptr = mm_malloc(size);
-        
-        /* If realloc() fails the original block is left untouched  */
-        if(!newptr) {
-            return 0;
-        }
-
-        /* Copy the old data. */
-        oldsize = GET_SIZE(HDRP(ptr));
-        if(size < oldsize) oldsize = size;
-        memcpy(newptr, ptr, oldsize);
-
-        /* Free the old block. */
+    // Out of memory in the block's arena? Move it to another one
+    if (newptr == NULL && size != 0 && NUM_ARENAS > 1 && (newptr = mm_malloc(size)) != NULL &&
+        ptr != NULL) {
+        memcpy(newptr, ptr, MIN(size, usable_size(ptr)));
         mm_free(ptr);
     }
-    
-    // check heap consistency
-    //if (mm_check()) exit(1);
-
     return newptr;
 }
 
-/**
- * Heap consistency checker. Also contains code for printing the state of
- * the free list.
+/*
+ * mm_memalign - Allocate a block whose payload is aligned to align bytes, a
+ * power of two.
  */
-static int mm_check() {
+void *mm_memalign(size_t align, size_t size)
+{
     void *bp;
 
-    for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        for (bp = freelistp[i]; bp != NULL; bp = *NXTP(bp)) {
-            // is every free block marked as free?
-            if (GET_ALLOC(HDRP(bp))) {
-                printf("There is an allocated block in the free list\n");
-                return 1;
-            }
-            if (GET_ALLOC(FTRP(bp))) {
-                printf("There is an allocated block in the free list\n");
-                return 1;
-            }
-            
-            // are there any contiguous free blocks?
-            if (!GET_ALLOC(HDRP(PREV_BLKP(bp)))) {
-                printf("There are contiguous free blocks %p (prev)\n", bp);
-                return 1;
-            }
-            if (!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
-                printf("There are contiguous free blocks %p (next)\n", bp);
-                return 1;
-            }
-            
-            // does every pointer point inside the heap
-            if (*NXTP(bp) != NULL && 
-                    (*NXTP(bp) < (void *)heap_listp || *NXTP(bp) > mem_heap_hi()))  {
-                printf("There is a next pointer outside the heap\n");
-                return 1;
-            }
-            if (*PRVP(bp) != NULL && 
-                    (*PRVP(bp) < (void *)heap_listp || *PRVP(bp) > mem_heap_hi())) {
-                printf("There is a prev pointer outside the heap\n");
-                return 1;
-            }
-            
-            // is every pointer pointing to a free block
-            if (*NXTP(bp) != NULL && GET_ALLOC(HDRP(*NXTP(bp)))) {
-                printf("A free block is pointing to an allocated block\n");
-                return 1;
-            }
-            if (*PRVP(bp) != NULL && GET_ALLOC(HDRP(*PRVP(bp)))) {
-                printf("A free block is pointing to an allocated block\n");
-                return 1;
-            }
-            
-         }
-    }
-    
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        // is every free block in the free list
-        int is_in_free_list = 0;
-        if (!GET_ALLOC(HDRP(bp))) {
-            for (int i = 0; i < NUM_FREE_LISTS; i++)
-                for (void *fbp = freelistp[i]; fbp != NULL; fbp = *NXTP(fbp))
-                    if (bp == fbp) is_in_free_list = 1;
-
-            if (!is_in_free_list) {
-                printf("There is a free block not in the free list\n");
-                return 1;
-            }
-        }
-    }
-    /*
-    // print the state of the free lists
-    int num_free_blocks[NUM_FREE_LISTS];
-    
-    for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        num_free_blocks[i] = 0;
-    }
+    ENTER_OWN();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    bp = heap_memalign(align, size);
+    LEAVE();
     
-    for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        for (void *testbp = freelistp[i]; testbp != NULL; testbp = *NXTP(testbp)) {
-            num_free_blocks[i]++;
-	    }
+    for (int i = 1; bp == NULL && size != 0 && i < NUM_ARENAS; i++) {
+        ENTER_NEXT(i);
+        bp = heap_memalign(align, size);
+        LEAVE();
     }
-    
-    for (int i = 0; i < NUM_FREE_LISTS; i++) {
-        if (num_free_blocks[i])
-            printf("%d %d;", i, num_free_blocks[i]);
+    return bp;
+}
+
+/*
+ * mm_calloc - Allocate a zeroed block for an array of n elements of size
+ * bytes each. Returns NULL if the size overflows.
+ */
+void *mm_calloc(size_t n, size_t size)
+{
+    void *bp;
+
+    if (size != 0 && n > SIZE_MAX / size) return NULL;
+    size *= n;
+
+    // Small blocks come from the fast paths, and are cheap to clear
+    if (size < ZERO_MIN) {
+        if ((bp = mm_malloc(size)) != NULL) memset(bp, 0, size);
+        return bp;
     }
-    printf("\n");
     
+    ENTER_OWN();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    bp = heap_calloc(size);
+    LEAVE();
     
-    // print the state of the heap
-    for (void *bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        printf("%p %d %d;", bp, GET_SIZE(HDRP(bp))/4, GET_ALLOC(HDRP(bp)));
+    for (int i = 1; bp == NULL && i < NUM_ARENAS; i++) {
+        ENTER_NEXT(i);
+        bp = heap_calloc(size);
+        LEAVE();
     }
-    printf("\n");*/
-    
-    return 0;
+    return bp;
 }
 
 /*
- * find_fit - Find a fit for a block with asize bytes
- * We look through the free list for a suitable fit, first in the bucket
- * matching the size. 
+ * mm_malloc_batch - Allocate n blocks of size bytes each into out. Returns
+ * the number of blocks allocated, which is less than n only if the heap is
+ * out of memory.
  */
-static void *find_fit(size_t asize) {
-    int index = get_index(asize) - 2;
-    if (index < 0) index = 0;
-   
-    void *bp = NULL;
-    void *testbp;
-    unsigned int size;
-    
-    for (int i = index; i < NUM_FREE_LISTS; i++) {
-        // For smaller blocks, if we don't find an exact match, skip.
-        if (i < 45) {
-            testbp = freelistp[i];
-            if (testbp == NULL) continue;
-            
-            size = GET_SIZE(HDRP(testbp));
-            
-            if (asize <= size) {
-		        bp = testbp;
-		        break;
-		    }
-		    
-		    continue;
-        }
+int mm_malloc_batch(size_t size, int n, void *out[])
+{
+    int got;
     
-        // For larger blocks, linear search through the linked list
-        for (testbp = freelistp[i]; testbp != NULL; testbp = *NXTP(testbp)) {
-            size = GET_SIZE(HDRP(testbp));
-            
-            if (asize <= size) {
-		        bp = testbp;
-		        break;
-		    }
-	    }
-	    
-	    // If we find a match, break and return.
-	    if (bp) break;
-    }
+    ENTER_OWN();
+#if THREAD_SAFE
+    remote_drain();
+#endif
+    got = heap_malloc_batch(size, n, out);
+    LEAVE();
     
-    return bp;
+    for (int i = 1; got < n && size != 0 && i < NUM_ARENAS; i++) {
+        ENTER_NEXT(i);
+        got += heap_malloc_batch(size, n - got, out + got);
+        LEAVE();
+    }
+    return got;
 }
 
 /*
- * extend_heap - Extend heap with free block and return its block pointer
+ * mm_free_batch - Free n blocks, sorting ptrs by address. Each run of blocks
+ * that follow one another in the heap is freed as one block; the others are
+ * freed one at a time.
  */
-/* $begin mmextendheap */
-static void *extend_heap(size_t words)
+void mm_free_batch(void *ptrs[], int n)
 {
-    char *bp;
-    size_t size;
+    int i, j;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+    qsort(ptrs, n, sizeof(ptrs[0]), cmp_addr);
     
-    if ((long)(bp = mem_sbrk(size)) == -1) return NULL;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && is_next(ptrs[j-1], ptrs[j]); j++);
+        
+        if (j - i == 1) {
+            mm_free(ptrs[i]);
+            continue;
+        }
+        ENTER_OWNER(ptrs[i]);
+        heap_free_run(&ptrs[i], j - i);
+        LEAVE();
+    }
+}
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-    PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
-    add_to_list(bp);
+/*
+ * mm_region_create - Make an empty region. Returns NULL if the heap is out of
+ * memory.
+ */
+mm_region_t *mm_region_create(void)
+{
+    mm_region_t *r;
 
-    /* Coalesce if the previous block was free */
-    void *coalesced_bp = coalesce(bp);
-    
-    // heap consistency check
-    //mm_check();
-    
-    return coalesced_bp;
+    if ((r = mm_malloc(sizeof(*r))) == NULL) return NULL;
+    r->cur = r->end = NULL;
+    r->chunks = NULL;
+    r->chunk_size = REGION_CHUNK;
+    return r;
 }
 
 /*
- * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * mm_region_alloc - Allocate size bytes from region r. They stay allocated
+ * until the region is reset or destroyed. Returns NULL if size is 0 or the
+ * heap is out of memory.
  */
-static void *coalesce(void *bp) {
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    size_t size = GET_SIZE(HDRP(bp));
+void *mm_region_alloc(mm_region_t *r, size_t size)
+{
+    char *p;
+
+    if (size == 0 || size > SIZE_MAX / 2) return NULL;
+    size = ALIGN(size);
+
+    if (size > (size_t)(r->end - r->cur)) {
+        // an object too large for a chunk gets one of its own, behind the
+        // current chunk so that the rest of that is still used
+        if (CHUNK_HDR_SIZE + size > r->chunk_size && r->chunks != NULL)
+            return region_chunk(r, CHUNK_HDR_SIZE + size, 0);
+        
+        if (region_chunk(r, MAX(r->chunk_size, CHUNK_HDR_SIZE + size), 1) == NULL)
+            return NULL;
+        r->chunk_size = MIN(2*r->chunk_size, REGION_CHUNK_MAX);
+    }
+
+    p = r->cur;
+    r->cur += size;
+    return p;
+}
+
+/*
+ * mm_region_reset - Free everything allocated from region r at once. The
+ * current chunk is kept for the objects to come, and lists the others for
+ * mm_free_batch, as many at a time as it can hold.
+ */
+void mm_region_reset(mm_region_t *r)
+{
+    char *keep = r->chunks;
+    void **ptrs = (void **)(keep + CHUNK_HDR_SIZE);
+    void *chunk;
+    int n, max;
+    
+    if (keep == NULL) return;
+    
+    max = (mm_malloc_usable_size(keep) - CHUNK_HDR_SIZE) / sizeof(void *);
+    for (chunk = *(void **)keep; chunk != NULL; ) {
+        for (n = 0; n < max && chunk != NULL; chunk = *(void **)chunk)
+            ptrs[n++] = chunk;
+        mm_free_batch(ptrs, n);
+    }
+
+    *(void **)keep = NULL;
+    r->cur = keep + CHUNK_HDR_SIZE;
+    r->end = keep + mm_malloc_usable_size(keep);
+}
+
+/*
+ * mm_region_destroy - Free region r and everything allocated from it
+ */
+void mm_region_destroy(mm_region_t *r)
+{
+    mm_region_reset(r);
+    mm_free(r->chunks);
+    mm_free(r);
+}
+
+/*
+ * mm_checkheap - Check the consistency of every arena in use, locking each
+ * in turn. Returns nonzero, having printed why, if one is inconsistent.
+ */
+int mm_checkheap(void)
+{
+    int ret = 0;
+    
+    for (int i = 0; i < NUM_ARENAS && ret == 0; i++) {
+#if THREAD_SAFE
+        pthread_mutex_lock(&arenas[i].lock);
+        arena = &arenas[i];
+#endif
+        if (arena->heap_listp != 0) ret = mm_check();
+        LEAVE();
+    }
+    return ret;
+}
+
+/* 
+ * heap_init - Set up an empty heap and forget all allocator state.
+ */
+static int heap_init(void)
+{
+    // Reset freelistp and the non-empty bitmap
+    for (int i = 0; i < NUM_FREE_LISTS; i++) arena->freelistp[i] = NULL;
+    for (int i = 0; i < NUM_MAP_WORDS; i++) arena->freemap[i] = 0;
+
+    // Empty the quick lists
+    for (int i = 0; i < QUICK_LISTS; i++) {
+#if LOCKFREE
+        arena->quickhead[i] = 0;
+#else
+        arena->quicklistp[i] = NULL;
+#endif
+        arena->quickcnt[i] = 0;
+        arena->refill_k[i] = REFILL_MIN;
+    }
+#if !LOCKFREE
+    arena->quickmap = 0;
+#endif
+
+    // Forget all runs
+    for (int i = 0; i < NUM_SLAB_CLASSES; i++) arena->slab_runs[i] = NULL;
+
+    // Forget all growing blocks
+    for (int i = 0; i < GROW_SLOTS; i++) arena->grow_bp[i] = NULL;
+
+    // Forget the sampled blocks, but not what they taught us
+    for (int i = 0; i < LIFE_SLOTS; i++) arena->life_bp[i] = NULL;
+    arena->tick = arena->live = 0;
+
+    // Only the first arena grows with mem_sbrk; the others start out with
+    // a mapped segment
+    if (arena != &arenas[0]) {
+        arena->heap_listp = 0;
+        arena->num_segs = 0;
+        return new_segment(CHUNKSIZE) == NULL ? -1 : 0;
+    }
+    
+    // Create the initial empty heap (4 words)
+    MEM_LOCK();
+    arena->heap_listp = mem_sbrk(4*WSIZE);
+    MEM_UNLOCK();
+    if (arena->heap_listp == (void *)-1) return -1;
+    
+    // Add alignment padding (word 0), prologue (word 1), epilogue (word 3)
+    PUT(arena->heap_listp, 0); /* Alignment padding */
+    PUT(arena->heap_listp + (1*WSIZE), PACK(DSIZE, 1 | PREV_ALLOC));
+    PUT(arena->heap_listp + (2*WSIZE), PACK(DSIZE, 1));
+    PUT(arena->heap_listp + (3*WSIZE), PACK(0, 1 | PREV_ALLOC));
+    arena->heap_listp += (2*WSIZE);
+
+    // The heap starts out as the one segment that mem_sbrk grows
+    arena->seg_listp[0] = arena->heap_listp;
+    arena->num_segs = 1;
+
+    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
+    if (extend_heap(CHUNKSIZE/WSIZE) == NULL) return -1;
+    return 0;
+}
+
+/*
+ * heap_malloc - Allocate a block, placed by the lifetime of its size class
+ */
+static void *heap_malloc(size_t size)
+{
+    return heap_malloc_hint(size, MM_AUTO);
+}
+
+/*
+ * heap_malloc_hint - Allocate a block placed by hint, and count it as live
+ */
+static void *heap_malloc_hint(size_t size, int hint)
+{
+    void *bp = heap_alloc(size, hint);
+
+    if (bp != NULL) life_alloc(bp, size);
+    return bp;
+}
+
+/* 
+ * heap_alloc - Allocate a block.
+ * Always allocate a block whose size is a multiple of the alignment.
+ * If we find a suitable free block we use it. Otherwise we extend the heap.
+ * Short-lived blocks are carved from the top of the free block, long-lived
+ * ones from the bottom.
+ */
+static void *heap_alloc(size_t size, int hint)
+{    
+    // Ignore spurious requests
+    if (size == 0) return NULL;
+    
+    // If still at the start, initialize the heap
+    if (arena->heap_listp == 0) {
+        heap_init();
+    }
+    
+    // Tiny requests go to a slab, unless no run can be made
+    char *bp;
+    if (size <= SLAB_MAX && (bp = slab_alloc(size)) != NULL) return bp;
+
+    // Huge requests get a region, unless none can be mapped
+    if (size >= MMAP_THRESHOLD && (bp = map_block(size)) != NULL) return bp;
+    if (size > MAX_REQUEST) return NULL;
+    
+    // Adjust block size to include overhead and alignment reqs.
+    size_t asize = ADJUST_SIZE(size);
+
+    // Reuse a recently freed block of the same size if there is one
+    int index = get_index(asize);
+    if (DEFER_COALESCE && index < QUICK_LISTS && (bp = quick_pop(index)) != NULL) {
+        return bp;
+    }
+
+    // Otherwise, if the exact bucket is empty too, carve a few more blocks of
+    // the same size for the requests to come
+    if (DEFER_COALESCE && index < QUICK_LISTS && arena->freelistp[index] == NULL &&
+        (bp = quick_refill(index, asize)) != NULL) {
+        return bp;
+    }
+
+    // Search the free list for a fit. No fit found? Get more memory
+    int young = short_lived(index, hint);
+    if ((bp = find_fit(asize)) == NULL) {
+        size_t extendsize = MAX(asize, young ? LIFE_CHUNK : CHUNKSIZE);
+        if ((bp = extend_heap(extendsize/WSIZE)) == NULL) return NULL;
+    }
+
+    // Place the block at the end its lifetime calls for, or else its size
+    int large = place_large(bp, asize, index, hint);
+    if (young || large) bp = place_high(bp, asize);
+    else place(bp, asize);
+    
+    // check heap consistency
+    //if (mm_check()) exit(1);
+    
+    return bp;
+}
+
+/*
+ * life_alloc - Count a block allocated for size bytes as live, and time it
+ * if it is a sample. A sample still in its slot that has outlived as many
+ * allocations as there are live blocks votes long-lived and makes room.
+ * The lock-free engine's quick lists bypass the count, so it learns nothing.
+ */
+static void life_alloc(void *bp, size_t size) {
+    if (LOCKFREE) return;
+
+    arena->live++;
+    if (++arena->tick % LIFE_SAMPLE != 0) return;
+    
+    // only blocks that get placed are worth learning about
+    if (size <= SLAB_MAX || size >= MMAP_THRESHOLD) return;
+    
+    int h = LIFE_HASH(bp);
+    if (arena->life_bp[h] != NULL) {
+        if (arena->tick - arena->life_at[h] < arena->live) return;
+        life_vote(arena->life_cls[h], 0);
+    }
+    arena->life_bp[h] = bp;
+    arena->life_at[h] = arena->tick;
+    arena->life_cls[h] = get_index(ADJUST_SIZE(size));
+}
+
+/*
+ * life_free - Count block bp as freed. If it was a sample, it votes on its
+ * size class: blocks that die before as many allocations as there are live
+ * blocks, the mean lifetime by Little's law, are young.
+ */
+static void life_free(void *bp) {
+    if (LOCKFREE) return;
+
+    arena->live--;
+    
+    int h = LIFE_HASH(bp);
+    if (arena->life_bp[h] != bp) return;
+    life_vote(arena->life_cls[h], arena->tick - arena->life_at[h] < arena->live);
+    arena->life_bp[h] = NULL;
+}
+
+/*
+ * life_vote - Count a vote on whether size class index dies young
+ */
+static void life_vote(int index, int young) {
+    signed char *v = &arena->life_vote[index];
+    
+    if (young && *v < LIFE_MAX) (*v)++;
+    else if (!young && *v > -LIFE_MAX) (*v)--;
+}
+
+/*
+ * short_lived - Return whether a block of size class index, allocated with
+ * the given hint, is placed with the short-lived blocks
+ */
+static int short_lived(int index, int hint) {
+    if (hint != MM_AUTO) return hint == MM_SHORT_LIVED;
+    return arena->life_vote[index] > 0;
+}
+
+/*
+ * place_large - Return whether a block of asize bytes, of size class index,
+ * is large enough to place at the top of free block bp, with the small ones
+ * at the bottom, so that they do not interleave. Only blocks with no lifetime
+ * to go by are placed by size, and never from the free block at the end of
+ * the heap, which more memory would coalesce with. Unless PLACE_SPLIT fixes
+ * it, the split between large and small tracks the median of the sizes
+ * placed, moving a SPLIT_STEP-th of the way towards each.
+ */
+static int place_large(void *bp, size_t asize, int index, int hint) {
+    size_t split = PLACE_SPLIT;
+    
+    if (split == 0) {
+        split = arena->split ? arena->split : asize;
+        if (asize > split) split += split / SPLIT_STEP;
+        else if (asize < split) split -= split / SPLIT_STEP;
+        arena->split = split;
+    }
+    if (hint != MM_AUTO || arena->life_vote[index] != 0) return 0;
+    return asize >= split && GET_SIZE(HDRP(NEXT_BLKP(bp))) != 0;
+}
+
+/*
+ * heap_free - Free a block. Coalesce on every free, unless the block can wait
+ * in a quick list.
+ */
+static void heap_free(void *ptr)
+{   
+    // don't free a null pointer
+    if(ptr == 0) return;
+    
+    // if still at the start, initialize the heap
+    if (arena->heap_listp == 0) {
+        heap_init();
+    }
+
+    // slots go back to their run
+    if (in_run(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+
+    heap_free_block(ptr);
+}
+
+/*
+ * heap_free_block - Free a block that is not a slot
+ */
+static void heap_free_block(void *ptr)
+{
+    life_free(ptr);
+
+    // a freed block stops growing
+    if (arena->grow_bp[GROW_HASH(ptr)] == ptr) arena->grow_bp[GROW_HASH(ptr)] = NULL;
+
+    // huge blocks give their region back
+    if (GET_MAPPED(HDRP(ptr))) {
+        MEM_LOCK();
+        mem_unmap((char *)ptr - ALIGNMENT);
+        MEM_UNLOCK();
+        return;
+    }
+
+    // small blocks wait in their quick list, the rest coalesce now; all of
+    // them do once the heap could be trimmed
+    int index = get_index(GET_SIZE(HDRP(ptr)));
+    void *bp = NULL;
+    if (DEFER_COALESCE && index < QUICK_LISTS) {
+        if (quick_push(ptr) >= QUICK_THRESHOLD) quick_flush(index);
+        else if (at_heap_end(ptr)) quick_flush_all();
+    } else {
+        bp = free_block(ptr);
+    }
+
+    // give a large free block at the end of the heap back
+    consolidate(bp);
+    trim_heap();
+    
+    // check heap consistency
+    //if (mm_check()) exit(1);
+}
+
+/*
+ * free_ptr - Free ptr, a slot if slot is set, into this thread's cache if it
+ * can, or onto the remote free stack of the arena that owns it if that is
+ * another thread's.
+ */
+static void free_ptr(void *ptr, int slot)
+{
+#if LOCKFREE
+    if (tcache_free(ptr, slot) || quick_free(ptr) || remote_free(ptr)) return;
+#elif THREAD_SAFE
+    if (tcache_free(ptr, slot) || remote_free(ptr)) return;
+#endif
+    ENTER_OWNER(ptr);
+    if (slot) slab_free(ptr);
+    else heap_free_block(ptr);
+    LEAVE();
+}
+
+/*
+ * usable_size - Return the payload size of allocated block bp: the whole slot,
+ * or the block or region less its header. Only the PREV_ALLOC bit of the
+ * header may change under us, so it is read without a lock.
+ */
+static size_t usable_size(void *bp)
+{
+    if (in_run(bp)) return RUNP(bp)->slot_size;
+    
+    unsigned int hdr = __atomic_load_n((unsigned int *)HDRP(bp), __ATOMIC_RELAXED);
+    return (hdr & MAPPED) ? (size_t)(hdr & ~0x7) * MAP_SCALE - ALIGNMENT : (hdr & ~0x7) - WSIZE;
+}
+
+/*
+ * heap_realloc - reallocates a block
+ * We use the following heuristics:
+ * - using the same block if we're reallocating to less
+ * - growing the heap by just the missing bytes if the block is at its end
+ * - combining with the next adjacent block if possible
+ * - combining with the previous adjacent block (and the next one) if
+ *   possible, moving the data down.
+ * If none of these works, we just use free and malloc. Blocks that keep
+ * growing take up to want bytes instead of asize, and keep their slack.
+ */
+static void *heap_realloc(void *ptr, size_t size)
+{
+    //printf("Realloc %p %d\n", ptr, size);
+    
+    size_t oldsize;
+    void *newptr;
+
+    /* If size == 0 then this is just free, and we return NULL. */
+    if(size == 0) {
+        heap_free(ptr);
+        return 0;
+    }
+
+    /* If oldptr is NULL, then this is just malloc. */
+    if(ptr == NULL) {
+        return heap_malloc(size);
+    }
+
+    // A slot can only stay put if the new size fits in it
+    if (in_run(ptr)) {
+        oldsize = RUNP(ptr)->slot_size;
+        if (size <= oldsize) return ptr;
+        
+        if ((newptr = heap_malloc(size)) == NULL) return 0;
+        memcpy(newptr, ptr, oldsize);
+        slab_free(ptr);
+        return newptr;
+    }
+
+    // A huge block is remapped, unless it stops being huge
+    if (GET_MAPPED(HDRP(ptr))) {
+        if (size >= MMAP_THRESHOLD) return remap_block(ptr, size);
+        
+        if ((newptr = heap_malloc(size)) == NULL) return 0;
+        memcpy(newptr, ptr, size);
+        heap_free(ptr);
+        return newptr;
+    }
+    
+    // A block too large for a header can only move to a region
+    if (size > MAX_REQUEST) {
+        if ((newptr = heap_malloc(size)) == NULL) return 0;
+        memcpy(newptr, ptr, GET_SIZE(HDRP(ptr)) - WSIZE);
+        heap_free(ptr);
+        return newptr;
+    }
+    
+    // Adjust block size to include overhead and alignment reqs.
+    size_t asize = ADJUST_SIZE(size);
+    size_t csize = GET_SIZE(HDRP(ptr));
+    void *next = NEXT_BLKP(ptr);
+    size_t nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+    size_t psize = GET_PREV_ALLOC(HDRP(ptr)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(ptr)));
+
+    // Count the growth, and reserve slack for blocks that keep growing
+    int grows = arena->grow_bp[GROW_HASH(ptr)] == ptr ? arena->grow_cnt[GROW_HASH(ptr)] : 0;
+    if (asize > csize && grows < GROW_AFTER) grows++;
+    size_t want = asize;
+    if (grows == GROW_AFTER) want += ALIGN(MIN(asize / GROW_DEN * GROW_NUM, GROW_CAP));
+
+    // If the block is the last one in the mem_sbrk heap, or only a free block
+    // follows it, and the free neighbors are too small, grow the heap by just
+    // the missing bytes so it can grow in place. Huge blocks move to a region.
+    if (asize > psize + csize + nsize && size < MMAP_THRESHOLD) {
+        void *last = nsize ? NEXT_BLKP(next) : next;
+
+        if (arena == &arenas[0] && (char *)last == SEG_END(0)) {
+            if (extend_heap(MAX(want - csize - nsize, 2*DSIZE)/WSIZE) == NULL)
+                return 0;
+            
+            // unless the heap grew into a new segment
+            nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+        }
+    }
+    
+    // If the new size is less than the old size, use the same block
+    if (asize <= csize) {
+        shrink_block(ptr, MIN(want, csize));
+        newptr = ptr;
+        
+    // If the next adjacent block is large enough and free, use it for the
+    // additional space
+    } else if (csize + nsize >= asize) {
+        // absorb the whole next free block
+        remove_from_list(next);
+        PUT(HDRP(ptr), PACK(csize + nsize, 1 | GET_PREV_ALLOC(HDRP(ptr))));
+        SET_PREV_ALLOC(NEXT_BLKP(ptr));
+        
+        // and give back what we don't need
+        shrink_block(ptr, MIN(want, csize + nsize));
+        newptr = ptr;
+        
+    // If the previous adjacent block is free and large enough, alone or with
+    // the next one, move the data down into it
+    } else if (psize + csize + nsize >= asize) {
+        newptr = PREV_BLKP(ptr);
+        
+        // absorb the free neighbors; the block before the previous free
+        // block must be allocated
+        remove_from_list(newptr);
+        if (nsize) remove_from_list(next);
+        PUT(HDRP(newptr), PACK(psize + csize + nsize, 1 | PREV_ALLOC));
+        SET_PREV_ALLOC(NEXT_BLKP(newptr));
+        
+        // the old payload may overlap its new home
+        memmove(newptr, ptr, MIN(csize - WSIZE, size));
+        
+        // and give back what we don't need
+        shrink_block(newptr, MIN(want, psize + csize + nsize));
+        
+    // Otherwise, just use malloc and free
+    } else {
+        newptr = heap_malloc(want - WSIZE);
+        
+        /* If realloc() fails the original block is left untouched  */
+        if(!newptr) {
+            return 0;
+        }
+
+        /* Copy the old data. */
+        oldsize = GET_SIZE(HDRP(ptr)) - WSIZE;
+        if(size < oldsize) oldsize = size;
+        memcpy(newptr, ptr, oldsize);
+
+        /* Free the old block. */
+        heap_free(ptr);
+    }
+
+    // Remember the block wherever it ended up
+    if (grows) {
+        arena->grow_bp[GROW_HASH(newptr)] = newptr;
+        arena->grow_cnt[GROW_HASH(newptr)] = grows;
+    }
+    
+    // check heap consistency
+    //if (mm_check()) exit(1);
+
+    return newptr;
+}
+
+/*
+ * heap_memalign - Allocate a block whose payload is aligned to align bytes.
+ * Alignments up to ALIGNMENT are a plain heap_malloc; larger ones split the
+ * leading padding off a free block as a free block of its own, and every
+ * block of such a size comes from the heap, even a huge one, as regions only
+ * align payloads to ALIGNMENT. Returns NULL if align is not a power of two,
+ * or if the block and its padding would be too large for a header.
+ */
+static void *heap_memalign(size_t align, size_t size)
+{
+    // Ignore spurious requests
+    if (size == 0 || (align & (align - 1)) != 0) return NULL;
+    if (align <= ALIGNMENT) return heap_malloc(size);
+    if (size > MAX_REQUEST || align > MAX_REQUEST - size) return NULL;
+    
+    // If still at the start, initialize the heap
+    if (arena->heap_listp == 0) {
+        heap_init();
+    }
+
+    char *bp = find_aligned(align, ADJUST_SIZE(size));
+    if (bp != NULL) life_alloc(bp, size);
+    return bp;
+}
+
+/*
+ * heap_calloc - Allocate a zeroed block of at least ZERO_MIN bytes. A block
+ * placed in a ZEROED free block only needs the words that held its links and
+ * footer cleared. Returns NULL if the block is too large for a header and
+ * can't be mapped.
+ */
+static void *heap_calloc(size_t size)
+{
+    // If still at the start, initialize the heap
+    if (arena->heap_listp == 0) {
+        heap_init();
+    }
+
+    // Huge requests get a fresh region, which is zero already
+    char *bp;
+    if (size >= MMAP_THRESHOLD && (bp = map_block(size)) != NULL) {
+        life_alloc(bp, size);
+        return bp;
+    }
+    if (size > MAX_REQUEST) return NULL;
+
+    size_t asize = ADJUST_SIZE(size);
+    if ((bp = find_fit(asize)) == NULL &&
+        (bp = extend_heap(MAX(asize, CHUNKSIZE)/WSIZE)) == NULL) return NULL;
+    
+    size_t csize = GET_SIZE(HDRP(bp));
+    int zeroed = GET_ZEROED(HDRP(bp));
+    place(bp, asize);
+    life_alloc(bp, size);
+    
+    if (!zeroed) {
+        memset(bp, 0, size);
+        return bp;
+    }
+    
+    // the links, and the footer if the block was not split
+    memset(bp, 0, 4*WSIZE);
+    if (GET_SIZE(HDRP(bp)) == csize) PUT(bp + csize - DSIZE, 0);
+    return bp;
+}
+
+/*
+ * heap_malloc_batch - Allocate n blocks of size bytes each into out, carving
+ * as many as fit in BATCH_BYTES out of one free block at a time. Slots and
+ * huge blocks don't come from free blocks, so they are allocated one by one,
+ * as are the blocks left over if no free block big enough can be had.
+ * Returns the number of blocks allocated.
+ */
+static int heap_malloc_batch(size_t size, int n, void **out)
+{
+    size_t asize = ADJUST_SIZE(size);
+    char *bp;
+    int i = 0;
+    
+    // Ignore spurious requests
+    if (size == 0) return 0;
+    
+    // If still at the start, initialize the heap
+    if (arena->heap_listp == 0) {
+        heap_init();
+    }
+
+    while (size > SLAB_MAX && size < MMAP_THRESHOLD && n - i > 1) {
+        int k = MIN(n - i, MAX(BATCH_BYTES / asize, 1));
+        size_t total = asize * k;
+        
+        if ((bp = find_fit(total)) == NULL &&
+            (bp = extend_heap(MAX(total, CHUNKSIZE)/WSIZE)) == NULL) break;
+        place_batch(bp, asize, k, &out[i]);
+        for (; k > 0; k--, i++) life_alloc(out[i], size);
+    }
+    
+    for (; i < n && (out[i] = heap_malloc(size)) != NULL; i++);
+    return i;
+}
+
+/*
+ * heap_free_run - Free n allocated blocks that follow one another in the heap
+ * as one block.
+ */
+static void heap_free_run(void **ptrs, int n)
+{
+    size_t size = 0;
+    
+    // freed blocks stop growing
+    for (int i = 0; i < n; i++) {
+        if (arena->grow_bp[GROW_HASH(ptrs[i])] == ptrs[i]) arena->grow_bp[GROW_HASH(ptrs[i])] = NULL;
+        life_free(ptrs[i]);
+        size += GET_SIZE(HDRP(ptrs[i]));
+    }
+    
+    PUT(HDRP(ptrs[0]), PACK(size, 1 | GET_PREV_ALLOC(HDRP(ptrs[0]))));
+    consolidate(free_block(ptrs[0]));
+
+    // give a large free block at the end of the heap back
+    trim_heap();
+}
+
+/*
+ * region_chunk - Get region r a chunk of size bytes, and return its first free
+ * byte. A current chunk becomes the one the region bumps through; any other
+ * goes behind it, holding a single object. Returns NULL if the heap is out of
+ * memory.
+ */
+static void *region_chunk(mm_region_t *r, size_t size, int current) {
+    char *chunk;
+
+    if ((chunk = mm_malloc(size)) == NULL) return NULL;
+
+    if (!current) {
+        *(void **)chunk = *(void **)r->chunks;
+        *(void **)r->chunks = chunk;
+        return chunk + CHUNK_HDR_SIZE;
+    }
+
+    // the whole block is ours to bump through, slack and all
+    *(void **)chunk = r->chunks;
+    r->chunks = chunk;
+    r->cur = chunk + CHUNK_HDR_SIZE;
+    r->end = chunk + mm_malloc_usable_size(chunk);
+    return r->cur;
+}
+
+/*
+ * cmp_addr - qsort comparator that orders pointers by address
+ */
+static int cmp_addr(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void * const *)a, y = (uintptr_t)*(void * const *)b;
+    
+    return (x > y) - (x < y);
+}
+
+/*
+ * is_next - Return whether next is the block right after block bp in the
+ * heap. Slots and huge blocks have no neighbors.
+ */
+static int is_next(void *bp, void *next) {
+    return bp != NULL && !in_run(bp) && !GET_MAPPED(HDRP(bp)) && NEXT_BLKP(bp) == next;
+}
+
+/**
+ * Heap consistency checker. Also contains code for printing the state of
+ * the free list.
+ */
+static int mm_check() {
+    void *bp;
+
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        // does the bitmap agree with the free list?
+        if (!(arena->freemap[i/32] & (1u << (i%32))) != (arena->freelistp[i] == NULL)) {
+            printf("The bitmap is out of sync with free list %d\n", i);
+            return 1;
+        }
+
+        // are the trees ordered and made of valid free blocks?
+        if (i >= TREE_INDEX) {
+            if (check_tree(arena->freelistp[i], i, 0, UINT_MAX)) return 1;
+            continue;
+        }
+
+        for (bp = arena->freelistp[i]; bp != NULL; bp = GET_PTR(NXTP(bp))) {
+            if (check_free_block(bp, i)) return 1;
+        }
+    }
+    
+    if (check_runs()) return 1;
+    if (check_quick()) return 1;
+
+    for (int s = 0; s < arena->num_segs; s++) {
+        size_t prev_alloc = PREV_ALLOC;
+        
+        for (bp = arena->seg_listp[s]; ; bp = NEXT_BLKP(bp)) {
+            // does every block know whether the previous one is allocated
+            if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc) {
+                printf("Block %p has the wrong prev allocated bit\n", bp);
+                return 1;
+            }
+            prev_alloc = GET_ALLOC(HDRP(bp)) ? PREV_ALLOC : 0;
+
+            // stop at the epilogue, which must end the segment
+            if (GET_SIZE(HDRP(bp)) == 0) {
+                if ((char *)bp != SEG_END(s)) {
+                    printf("Segment %d ends at the wrong place\n", s);
+                    return 1;
+                }
+                break;
+            }
+
+            // is every free block in the free list
+            if (!GET_ALLOC(HDRP(bp)) && !in_free_list(bp)) {
+                printf("There is a free block not in the free list\n");
+                return 1;
+            }
+        }
+    }
+    /*
+    // print the state of the free lists
+    int num_free_blocks[NUM_FREE_LISTS];
+    
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        num_free_blocks[i] = 0;
+    }
+    
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        for (void *testbp = arena->freelistp[i]; testbp != NULL; testbp = GET_PTR(NXTP(testbp))) {
+            num_free_blocks[i]++;
+	    }
+    }
+    
+    for (int i = 0; i < NUM_FREE_LISTS; i++) {
+        if (num_free_blocks[i])
+            printf("%d %d;", i, num_free_blocks[i]);
+    }
+    printf("\n");
+    
+    
+    // print the state of the heap
+    for (void *bp = arena->heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        printf("%p %d %d;", bp, GET_SIZE(HDRP(bp))/4, GET_ALLOC(HDRP(bp)));
+    }
+    printf("\n");*/
+    
+    return 0;
+}
+
+/**
+ * Helper for mm_check that validates the runs, both through the heap and
+ * through the lists of runs with free slots.
+ */
+static int check_runs() {
+    for (int c = 0; c < NUM_SLAB_CLASSES; c++) {
+        for (run_t *run = arena->slab_runs[c]; run != NULL; run = run->next) {
+            // is every listed run a run of this class with free slots?
+            if (!in_run(run) || run->slot_size != (c+1)*ALIGNMENT) {
+                printf("Run %p is in the wrong list\n", run);
+                return 1;
+            }
+            if (run->nfree == 0) {
+                printf("Full run %p is in a list\n", run);
+                return 1;
+            }
+            if (run->next != NULL && run->next->prev != run) {
+                printf("Run %p has a bad next run\n", run);
+                return 1;
+            }
+        }
+    }
+
+    for (int s = 0; s < arena->num_segs; s++)
+    for (void *bp = arena->seg_listp[s]; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+        if (!in_run(bp)) continue;
+
+        run_t *run = bp;
+        unsigned int used = 0;
+        
+        // is the run an allocated block that covers the whole run?
+        if (!GET_ALLOC(HDRP(bp)) || RUNP(bp) != run ||
+                GET_SIZE(HDRP(bp)) < RUN_SIZE + WSIZE) {
+            printf("Run %p is not a run-sized allocated block\n", run);
+            return 1;
+        }
+
+        // does the free count agree with the bitmap?
+        for (int w = 0; w < RUN_MAP_WORDS; w++)
+            used += __builtin_popcount(run->map[w]);
+        if (run->nfree != run->nslots - (used - (RUN_MAP_WORDS*32 - run->nslots))) {
+            printf("Run %p has the wrong free count\n", run);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Helper for mm_check that validates the quick lists.
+ */
+static int check_quick() {
+    for (int i = 0; i < QUICK_LISTS; i++) {
+        int count = 0;
+#if LOCKFREE
+        unsigned int off = HEAD_OFF(arena->quickhead[i]);
+        void *first = off ? arena->heap_listp + (long)(int)off*DSIZE : NULL;
+
+        // other threads may be pushing and popping, so only check an idle heap
+#else
+        void *first = arena->quicklistp[i];
+
+        // does the bitmap agree with the quick list?
+        if (!(arena->quickmap & (1ULL << i)) != (first == NULL)) {
+            printf("The bitmap is out of sync with quick list %d\n", i);
+            return 1;
+        }
+#endif
+
+        // is every block still marked allocated, and of the right size?
+        for (void *bp = first; bp != NULL; bp = GET_PTR(NXTP(bp))) {
+            if (!GET_ALLOC(HDRP(bp)) || get_index(GET_SIZE(HDRP(bp))) != i) {
+                printf("Block %p does not belong in quick list %d\n", bp, i);
+                return 1;
+            }
+            count++;
+        }
+
+        // a lock-free push leaves the list long if the arena is busy
+        if (count != arena->quickcnt[i] || (!LOCKFREE && count >= QUICK_THRESHOLD)) {
+            printf("Quick list %d has the wrong count\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Helper for mm_check that validates a single block found in free list index.
+ */
+static int check_free_block(void *bp, int index) {
+    // is every free block in the right list?
+    if (get_index(GET_SIZE(HDRP(bp))) != index) {
+        printf("Free block %p is in the wrong list\n", bp);
+        return 1;
+    }
+
+    // is every free block marked as free?
+    if (GET_ALLOC(HDRP(bp))) {
+        printf("There is an allocated block in the free list\n");
+        return 1;
+    }
+    if (GET_SIZE(FTRP(bp)) != GET_SIZE(HDRP(bp)) || GET_ALLOC(FTRP(bp))) {
+        printf("Free block %p has a bad footer\n", bp);
+        return 1;
+    }
+
+    // does every zeroed block read as zero past its links?
+    if (GET_ZEROED(HDRP(bp))) {
+        for (char *p = (char *)bp + 4*WSIZE; p < FTRP(bp); p += WSIZE) {
+            if (GET(p) != 0) {
+                printf("Zeroed free block %p has a nonzero word at %p\n", bp, p);
+                return 1;
+            }
+        }
+    }
+    
+    // are there any contiguous free blocks?
+    if (!GET_PREV_ALLOC(HDRP(bp))) {
+        printf("There are contiguous free blocks %p (prev)\n", bp);
+        return 1;
+    }
+    if (!GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+        printf("There are contiguous free blocks %p (next)\n", bp);
+        return 1;
+    }
+    
+    // does every pointer point inside the heap
+    if (GET_PTR(NXTP(bp)) != NULL && !in_heap(GET_PTR(NXTP(bp))))  {
+        printf("There is a next pointer outside the heap\n");
+        return 1;
+    }
+    if (GET_PTR(PRVP(bp)) != NULL && !in_heap(GET_PTR(PRVP(bp)))) {
+        printf("There is a prev pointer outside the heap\n");
+        return 1;
+    }
+    
+    // is every pointer pointing to a free block
+    if (GET_PTR(NXTP(bp)) != NULL && GET_ALLOC(HDRP(GET_PTR(NXTP(bp))))) {
+        printf("A free block is pointing to an allocated block\n");
+        return 1;
+    }
+    if (GET_PTR(PRVP(bp)) != NULL && GET_ALLOC(HDRP(GET_PTR(PRVP(bp))))) {
+        printf("A free block is pointing to an allocated block\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Helper for mm_check that validates the tree rooted at t, whose sizes must
+ * all lie strictly between lo and hi, along with each node's same-size list.
+ */
+static int check_tree(void *t, int index, size_t lo, size_t hi) {
+    if (t == NULL) return 0;
+
+    size_t size = GET_SIZE(HDRP(t));
+    
+    // is the tree ordered by size?
+    if (size <= lo || size >= hi) {
+        printf("Tree node %p is out of order\n", t);
+        return 1;
+    }
+
+    // is the node marked as a node, and does its list hold only its size?
+    if (GET_PTR(PRVP(t)) != NULL) {
+        printf("Tree node %p has a prev pointer\n", t);
+        return 1;
+    }
+    for (void *bp = t; bp != NULL; bp = GET_PTR(NXTP(bp))) {
+        if (check_free_block(bp, index)) return 1;
+        if (GET_SIZE(HDRP(bp)) != size) {
+            printf("Block %p is in the list of the wrong tree node\n", bp);
+            return 1;
+        }
+    }
+
+    return check_tree(GET_PTR(LFTP(t)), index, lo, size) ||
+           check_tree(GET_PTR(RGTP(t)), index, size, hi);
+}
+
+/**
+ * Helper for mm_check that returns whether the given free block can be
+ * reached from its free list.
+ */
+static int in_free_list(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    int index = get_index(size);
+    void *t = arena->freelistp[index];
+
+    // find the tree node holding the list of blocks of this size
+    if (index >= TREE_INDEX) {
+        while (t != NULL && GET_SIZE(HDRP(t)) != size)
+            t = (size < GET_SIZE(HDRP(t))) ? GET_PTR(LFTP(t)) : GET_PTR(RGTP(t));
+    }
+
+    for (; t != NULL; t = GET_PTR(NXTP(t)))
+        if (t == bp) return 1;
+    
+    return 0;
+}
+
+/*
+ * find_fit - Find a fit for a block with asize bytes
+ * We use the bitmap to jump straight to the non-empty buckets, starting with
+ * the one matching the size. Exact buckets hand out their first block; tree
+ * buckets hand out the best fit.
+ */
+static void *find_fit(size_t asize) {
+    int index = get_index(asize);
+    void *bp;
+
+    for (int i = next_nonempty(index); i >= 0; i = next_nonempty(i + 1)) {
+        // Exact-size buckets only hold blocks that are big enough, so the
+        // first one will do.
+        if (i < TREE_INDEX) return arena->freelistp[i];
+
+        // Our own tree may only hold smaller blocks, so keep looking
+        if ((bp = tree_fit(&arena->freelistp[i], asize)) != NULL) return bp;
+    }
+
+    // Coalesce the quick lists and try again
+    if (DEFER_COALESCE && quick_flush_all()) return find_fit(asize);
+
+    return NULL;
+}
+
+/*
+ * find_aligned - Allocate a block of asize bytes whose payload is aligned to
+ * align, a power of two. We get a block with room to spare, and split off
+ * the leading padding as a free block before placing the block.
+ */
+static void *find_aligned(size_t align, size_t asize) {
+    size_t need = asize + align + 2*DSIZE;
+    char *bp, *p;
+
+    if ((bp = find_fit(need)) == NULL &&
+        (bp = extend_heap(MAX(need, CHUNKSIZE)/WSIZE)) == NULL) return NULL;
+
+    // the padding must be empty or big enough to be a free block
+    p = (char *)(((uintptr_t)bp + (align-1)) & ~(uintptr_t)(align-1));
+    while (p != bp && p - bp < 2*DSIZE) p += align;
+
+    if (p != bp) {
+        size_t csize = GET_SIZE(HDRP(bp));
+        size_t pad = p - bp;
+        size_t zeroed = GET_ZEROED(HDRP(bp));
+        
+        // leading free block, whose previous block is allocated
+        remove_from_list(bp);
+        PUT(HDRP(bp), PACK(pad, PREV_ALLOC | zeroed));
+        PUT(FTRP(bp), PACK(pad, 0));
+        add_to_list(bp);
+
+        // aligned free block for place to split
+        PUT(HDRP(p), PACK(csize-pad, zeroed));
+        PUT(FTRP(p), PACK(csize-pad, 0));
+        add_to_list(p);
+    }
+
+    place(p, asize);
+    return p;
+}
+
+/*
+ * in_run - Return whether p lies in a run, using the run bitmap. The bitmap
+ * is shared by all arenas, so its words are read and written atomically.
+ */
+static int in_run(void *p) {
+    uintptr_t page = ((char *)p - run_base) / RUN_SIZE;
+
+    return (char *)p >= run_base && page < RUN_SPAN / RUN_SIZE &&
+           (__atomic_load_n(&runmap[page/32], __ATOMIC_RELAXED) & (1u << (page%32)));
+}
+
+/*
+ * slab_alloc - Allocate a slot for a request of at most SLAB_MAX bytes from
+ * the first run of its class with a free slot. Returns NULL if no run can be
+ * made.
+ */
+static void *slab_alloc(size_t size) {
+    int cls = (size - 1) / ALIGNMENT;
+    run_t *run = arena->slab_runs[cls];
+    int w = 0;
+
+    if (run == NULL && (run = run_create(cls)) == NULL) return NULL;
+
+    // take the first free slot
+    while (run->map[w] == ~0u) w++;
+    int slot = w*32 + __builtin_ctz(~run->map[w]);
+    run->map[w] |= 1u << (slot%32);
+
+    // full runs leave the list
+    if (--run->nfree == 0) {
+        arena->slab_runs[cls] = run->next;
+        if (run->next != NULL) run->next->prev = NULL;
+    }
+
+    return (char *)run + RUN_HDR_SIZE + slot*run->slot_size;
+}
+
+/*
+ * slab_free - Free the slot p. A run that becomes empty goes back to the heap,
+ * unless it is the only run of its class with free slots and doesn't pin the
+ * end of the heap.
+ */
+static void slab_free(void *p) {
+    life_free(p);
+    
+    run_t *run = RUNP(p);
+    int cls = run->slot_size/ALIGNMENT - 1;
+    int slot = ((char *)p - (char *)run - RUN_HDR_SIZE) / run->slot_size;
+
+    run->map[slot/32] &= ~(1u << (slot%32));
+
+    // a run that was full gets its free slot listed again
+    if (run->nfree++ == 0) {
+        run->prev = NULL;
+        run->next = arena->slab_runs[cls];
+        if (arena->slab_runs[cls] != NULL) arena->slab_runs[cls]->prev = run;
+        arena->slab_runs[cls] = run;
+    }
+
+    if (run->nfree == run->nslots &&
+        (run->prev != NULL || run->next != NULL || run_pins_heap(run))) run_release(run);
+
+    // give a large free block at the end of the heap back
+    consolidate(NULL);
+    trim_heap();
+}
+
+/*
+ * run_release - Take empty run off its class's list and give it back to the
+ * heap.
+ */
+static void run_release(run_t *run) {
+    int cls = run->slot_size/ALIGNMENT - 1;
+
+    // remove from the list
+    if (run->prev != NULL) run->prev->next = run->next;
+    else arena->slab_runs[cls] = run->next;
+    if (run->next != NULL) run->next->prev = run->prev;
+
+    // unmark the page and free the block
+    uintptr_t page = ((char *)run - run_base) / RUN_SIZE;
+    __atomic_fetch_and(&runmap[page/32], ~(1u << (page%32)), __ATOMIC_RELAXED);
+    free_block(run);
+}
+
+/*
+ * trim_runs - Release the empty runs kept for their classes while they end
+ * the heap, but for a free block, so that trim_heap can shrink it past them.
+ */
+static void trim_runs(void) {
+    for (int released = 1; released; ) {
+        released = 0;
+        for (int cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+            run_t *run = arena->slab_runs[cls];
+            if (run != NULL && run->nfree == run->nslots && at_heap_end(run)) {
+                run_release(run);
+                released = 1;
+            }
+        }
+    }
+}
+
+/*
+ * run_pins_heap - Return whether empty run is all that keeps trim_heap from
+ * shrinking the heap: it ends the heap, but for a free block, and would leave
+ * a free block of TRIM_THRESHOLD bytes there if it were freed.
+ */
+static int run_pins_heap(run_t *run) {
+    if (!at_heap_end(run)) return 0;
+    
+    size_t size = GET_SIZE(HDRP(run)) + GET_SIZE(HDRP(NEXT_BLKP(run)));
+    if (!GET_PREV_ALLOC(HDRP(run))) size += GET_SIZE(HDRP(PREV_BLKP(run)));
+    return size >= TRIM_THRESHOLD;
+}
+
+/*
+ * run_create - Make a new run for the given slab class and list it. Returns
+ * NULL if there is no memory, or the run would lie past the run bitmap.
+ */
+static run_t *run_create(int cls) {
+    run_t *run = find_aligned(RUN_SIZE, ADJUST_SIZE(RUN_SIZE));
+    
+    if (run == NULL) return NULL;
+
+    uintptr_t page = ((char *)run - run_base) / RUN_SIZE;
+    if (page >= RUN_SPAN / RUN_SIZE) {
+        free_block(run);
+        return NULL;
+    }
+    __atomic_fetch_or(&runmap[page/32], 1u << (page%32), __ATOMIC_RELAXED);
+    if (page/32 >= arena->runmap_words) arena->runmap_words = page/32 + 1;
+
+    // slots past the end of the run are marked in use
+    run->slot_size = (cls+1)*ALIGNMENT;
+    run->nslots = (RUN_SIZE - RUN_HDR_SIZE) / run->slot_size;
+    run->nfree = run->nslots;
+    for (int i = 0; i < RUN_MAP_WORDS; i++) {
+        int first = i*32;
+        if (first + 32 <= run->nslots) run->map[i] = 0;
+        else if (first >= run->nslots) run->map[i] = ~0u;
+        else run->map[i] = ~0u << (run->nslots - first);
+    }
+
+    run->prev = NULL;
+    run->next = arena->slab_runs[cls];
+    if (arena->slab_runs[cls] != NULL) arena->slab_runs[cls]->prev = run;
+    arena->slab_runs[cls] = run;
+    return run;
+}
+
+#if THREAD_SAFE
+/*
+ * tcache_class - Return the cache class for a request of size bytes, or -1 if
+ * it is too large to be cached.
+ */
+static int tcache_class(size_t size) {
+    if (size <= SLAB_MAX) return (size - 1) / ALIGNMENT;
+    if (LOCKFREE || size >= MMAP_THRESHOLD) return -1;
+    
+    int index = get_index(ADJUST_SIZE(size));
+    return index < QUICK_LISTS ? NUM_SLAB_CLASSES + index : -1;
+}
+
+/*
+ * tcache_check - Empty this thread's cache if mm_init reset the heap since it
+ * was filled, and make sure it is drained when the thread exits.
+ */
+static void tcache_check(void) {
+    unsigned long gen = __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE);
+    
+    if (tcache.gen == gen) return;
+
+    for (int c = 0; c < TCACHE_CLASSES; c++) {
+        tcache.list[c] = NULL;
+        tcache.count[c] = 0;
+    }
+    tcache.gen = gen;
+
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
+    }
+}
+
+/*
+ * tcache_alloc - Take a block for a request of size bytes from this thread's
+ * cache, refilling the class from the heap if it is empty. Returns NULL if the
+ * request is too large to be cached or the heap is out of memory.
+ */
+static void *tcache_alloc(size_t size) {
+    int c = tcache_class(size);
+    void *bp;
+    
+    if (c < 0) return NULL;
+    tcache_check();
+
+    // refill with blocks that fit every request of the class, as a slab class
+    // gets plain blocks when no run can be made
+    if (tcache.list[c] == NULL) {
+        size_t csize = c < NUM_SLAB_CLASSES ? (size_t)(c+1)*ALIGNMENT : size;
+        
+        ENTER_OWN();
+        remote_drain();
+        for (int i = 0; i < TCACHE_BATCH && (bp = heap_malloc(csize)) != NULL; i++) {
+            *(void **)bp = tcache.list[c];
+            tcache.list[c] = bp;
+            tcache.count[c]++;
+        }
+        LEAVE();
+        if (tcache.list[c] == NULL) return NULL;
+    }
+
+    bp = tcache.list[c];
+    tcache.list[c] = *(void **)bp;
+    tcache.count[c]--;
+    return bp;
+}
+
+/*
+ * tcache_free - Put a freed block, a slot if slot is set, in this thread's
+ * cache, draining the class to the heap if it is full. Returns 0 if the block
+ * is too large to be cached.
+ * While the caller owns the block, its run bit can't change, and neither can
+ * its header, except for the PREV_ALLOC bit, which a neighbor may set or clear
+ * under the lock.
+ */
+static int tcache_free(void *bp, int slot) {
+    int c;
+    
+    if (slot) {
+        c = RUNP(bp)->slot_size / ALIGNMENT - 1;
+    } else if (LOCKFREE) {
+        return 0;
+    } else {
+        unsigned int hdr = __atomic_load_n((unsigned int *)HDRP(bp), __ATOMIC_RELAXED);
+        int index = get_index(hdr & ~0x7);
+        
+        // the size of a huge block is in MAP_SCALE units, so it is no class
+        if ((hdr & MAPPED) || index >= QUICK_LISTS) return 0;
+        c = NUM_SLAB_CLASSES + index;
+    }
+    tcache_check();
+
+    if (tcache.count[c] == TCACHE_MAX) {
+        tcache_drain(&tcache.list[c], TCACHE_BATCH);
+        tcache.count[c] -= TCACHE_BATCH;
+    }
+
+    *(void **)bp = tcache.list[c];
+    tcache.list[c] = bp;
+    tcache.count[c]++;
+    return 1;
+}
+
+/*
+ * tcache_key_create - Create the key whose destructor drains caches
+ */
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * tcache_release - Give an exiting thread's cached blocks back to the heap,
+ * unless mm_init has thrown them away already.
+ */
+static void tcache_release(void *arg) {
+    tcache_t *tc = arg;
+    
+    if (tc->gen != __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) return;
+    
+    for (int c = 0; c < TCACHE_CLASSES; c++) {
+        tcache_drain(&tc->list[c], tc->count[c]);
+        tc->count[c] = 0;
+    }
+}
+
+/*
+ * tcache_drain - Free the first n blocks of a cache list, each into the arena
+ * that owns it, keeping an arena locked for as long as its blocks come in a
+ * row. Blocks of other threads' arenas go onto their remote free stacks.
+ */
+static void tcache_drain(void **listp, int n) {
+    arena_t *held = NULL;
+    
+    for (int i = 0; i < n; i++) {
+        void *bp = *listp;
+        arena_t *owner = owner_arena(bp);
+        
+        *listp = *(void **)bp;
+        if (owner != NULL && owner != own_arena) {
+            remote_push(owner, bp);
+            continue;
+        }
+        if (owner != held) {
+            if (held != NULL) LEAVE();
+            ENTER_OWNER(bp);
+            held = owner;
+        }
+        heap_free(bp);
+    }
+    if (held != NULL) LEAVE();
+}
+
+/*
+ * arenas_create - Set up the arena locks
+ */
+static void arenas_create(void) {
+    for (int i = 0; i < NUM_ARENAS; i++) pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+/*
+ * owner_arena - Return the arena whose segments hold p, or NULL if p is in
+ * none of them, like a huge block. Segments are only ever added while threads
+ * use the heap, and num_segs is published after the segment it counts. The
+ * end of the mem_sbrk heap is read without the memory lock, as a block the
+ * caller owns stays below it however the heap grows or shrinks.
+ */
+static arena_t *owner_arena(void *p) {
+    if ((char *)p >= (char *)mem_heap_lo() && (char *)p <= (char *)mem_heap_hi())
+        return &arenas[0];
+
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        int n = __atomic_load_n(&a->num_segs, __ATOMIC_ACQUIRE);
+        
+        // the first segment of the first arena is the mem_sbrk heap
+        for (int s = (i == 0); s < n; s++) {
+            if ((char *)p >= a->seg_listp[s] && (char *)p < a->seg_end[s]) return a;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * lock_own_arena - Lock the arena this thread allocates from and make it the
+ * current arena. New threads are handed arenas round-robin, and a thread
+ * that finds its arena locked moves to the next one that isn't.
+ */
+static void lock_own_arena(void) {
+    if (own_arena == NULL) {
+        pthread_once(&arena_once, arenas_create);
+        own_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+    }
+
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arena_t *a = &arenas[(own_arena - arenas + i) % NUM_ARENAS];
+        if (pthread_mutex_trylock(&a->lock) == 0) {
+            arena = own_arena = a;
+            return;
+        }
+    }
+    
+    // every arena is busy, so wait for our own
+    pthread_mutex_lock(&own_arena->lock);
+    arena = own_arena;
+}
+
+/*
+ * lock_next_arena - Lock the i-th arena after this thread's, and make it the
+ * current arena, for a request this thread's arena is out of memory for.
+ * The blocks other threads freed to it are taken in first.
+ */
+static void lock_next_arena(int i) {
+    arena = &arenas[(own_arena - arenas + i) % NUM_ARENAS];
+    pthread_mutex_lock(&arena->lock);
+    remote_drain();
+}
+
+/*
+ * lock_owner - Lock the arena that owns p and make it the current arena.
+ * Blocks outside every arena's segments are freed in this thread's arena.
+ */
+static void lock_owner(void *p) {
+    arena_t *a = p != NULL ? owner_arena(p) : NULL;
+    
+    if (a == NULL) {
+        lock_own_arena();
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+}
+
+/*
+ * remote_free - Push a block onto the remote free stack of the arena that
+ * owns it, if that isn't this thread's arena. Returns 0 if the block is this
+ * thread's to free, or huge.
+ */
+static int remote_free(void *bp) {
+    arena_t *a = owner_arena(bp);
+    
+    if (a == NULL || a == own_arena) return 0;
+    remote_push(a, bp);
+    return 1;
+}
+
+/*
+ * remote_push - Push a block onto the remote free stack of arena a without
+ * taking any lock. The block is linked through its first word.
+ */
+static void remote_push(arena_t *a, void *bp) {
+    void *head = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+
+    do {
+        *(void **)bp = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_free, &head, bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain - Free the blocks other threads pushed onto the current
+ * arena's remote free stack. The caller holds the arena's lock, and takes
+ * the whole stack at once, so the blocks can't be popped twice.
+ */
+static void remote_drain(void) {
+    void *bp;
+    
+    if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) == NULL) return;
+    
+    bp = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        heap_free(bp);
+        bp = next;
+    }
+}
+
+#if LOCKFREE
+/*
+ * quick_alloc - Take a block for a request of size bytes off a quick list of
+ * this thread's arena without locking it. Returns NULL if the request has no
+ * quick list, or the list is empty.
+ */
+static void *quick_alloc(size_t size) {
+    int index;
+    
+    if (size <= SLAB_MAX || size >= MMAP_THRESHOLD || own_arena == NULL) return NULL;
+    if ((index = get_index(ADJUST_SIZE(size))) >= QUICK_LISTS) return NULL;
+    
+    arena = own_arena;
+    return quick_pop(index);
+}
+
+/*
+ * quick_free - Push a small block onto its quick list in the arena that owns
+ * it without locking the arena. A list that gets too long is coalesced if
+ * the arena is free. Returns 0 if the block has no quick list. Slots never
+ * get here, as the thread cache takes them all.
+ */
+static int quick_free(void *bp) {
+    unsigned int hdr = __atomic_load_n((unsigned int *)HDRP(bp), __ATOMIC_RELAXED);
+    int index = get_index(hdr & ~0x7);
+    arena_t *a;
+    
+    if (index >= QUICK_LISTS || (a = owner_arena(bp)) == NULL) return 0;
+
+    arena = a;
+    if (quick_push(bp) >= QUICK_THRESHOLD && pthread_mutex_trylock(&a->lock) == 0) {
+        quick_flush(index);
+        LEAVE();
+    }
+    return 1;
+}
+#endif
+#endif
+
+/*
+ * extend_heap - Extend heap with free block and return its block pointer
+ */
+/* $begin mmextendheap */
+static void *extend_heap(size_t words)
+{
+    char *bp;
+    size_t size;
+
+    /* Allocate a multiple of ALIGNMENT to maintain alignment */
+    size = ALIGN(words * WSIZE);
+    
+    /* Once the first segment can't grow, map another one. Only the first
+       arena grows with mem_sbrk, and only while its blocks fit a header. */
+    if (arena != &arenas[0] || size > MAX_BLOCK - mem_heapsize())
+        return new_segment(size);
+    MEM_LOCK();
+    int zeroed = mem_heap_clean() == (char *)mem_heap_hi() + 1 ? ZEROED : 0;
+    bp = mem_sbrk(size);
+    MEM_UNLOCK();
+    if ((long)bp == -1) return new_segment(size);
+
+    /* Initialize free block header/footer and the epilogue header */
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | zeroed)); /* Free block header */
+    PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+
+    /* Coalesce if the previous block was free */
+    void *coalesced_bp = coalesce(bp);
+    
+    // heap consistency check
+    //mm_check();
+    
+    return coalesced_bp;
+}
+
+/*
+ * new_segment - Map a new heap segment with a free block of at least size
+ * bytes, and return that block. Segments grow with the heap, by a
+ * SEG_GROWTH-th of it, so the table of MAX_SEGMENTS lasts, up to MAX_BLOCK.
+ * Returns NULL if there are too many segments, or the new one is too large
+ * or can't be mapped within reach of heap_listp. The first
+ * segment of an arena sets its heap_listp. Other threads may look the
+ * segment up as soon as num_segs counts it.
+ */
+static void *new_segment(size_t size)
+{
+    size_t ssize = 0;
+    char *base;
+
+    for (int s = 0; s < arena->num_segs; s++) ssize += SEG_END(s) - arena->seg_listp[s];
+    ssize = MAX(size + 4*WSIZE, MAX(SEG_SIZE, MIN(ssize / SEG_GROWTH, MAX_BLOCK)));
+    ssize = (ssize + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (arena->num_segs == MAX_SEGMENTS || ssize > MAX_BLOCK) return NULL;
+    MEM_LOCK();
+    base = mem_map(ssize);
+    MEM_UNLOCK();
+    if (base == NULL) return NULL;
+    if (arena->heap_listp == 0) arena->heap_listp = base + (2*WSIZE);
+    
+    uintptr_t lo = (uintptr_t)base, hi = lo + ssize, h = (uintptr_t)arena->heap_listp;
+    if ((hi > h && hi - h >= OFFSET_SPAN) || (lo < h && h - lo >= OFFSET_SPAN)) {
+        MEM_LOCK();
+        mem_unmap(base);
+        MEM_UNLOCK();
+        return NULL;
+    }
+
+    // Same layout as the first segment: padding, prologue, free block, epilogue
+    PUT(base, 0);
+    PUT(base + (1*WSIZE), PACK(DSIZE, 1 | PREV_ALLOC));
+    PUT(base + (2*WSIZE), PACK(DSIZE, 1));
+    arena->seg_listp[arena->num_segs] = base + (2*WSIZE);
+    arena->seg_end[arena->num_segs] = base + ssize;
+    __atomic_store_n(&arena->num_segs, arena->num_segs + 1, __ATOMIC_RELEASE);
+
+    char *bp = base + (4*WSIZE);
+    PUT(HDRP(bp), PACK(ssize - 4*WSIZE, PREV_ALLOC | ZEROED));
+    PUT(FTRP(bp), PACK(ssize - 4*WSIZE, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
+    add_to_list(bp);
+    return bp;
+}
+
+/*
+ * in_heap - Return whether p lies in one of the current arena's segments
+ */
+static int in_heap(void *p)
+{
+    for (int s = 0; s < arena->num_segs; s++) {
+        if ((char *)p >= arena->seg_listp[s] && (char *)p < SEG_END(s)) return 1;
+    }
+    return 0;
+}
+
+/*
+ * coalesce - Boundary tag coalescing. Takes a free block that is not in the
+ * free list yet, and adds the coalesced block to the free list exactly once,
+ * so a free block pays for at most one tree insertion. Return ptr to
+ * coalesced block
+ */
+static void *coalesce(void *bp) {
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t zeroed = GET_ZEROED(HDRP(bp));
 
     if (prev_alloc && next_alloc) {
         // case 1: previous and next are both allocated
-        return bp;
     } else if (prev_alloc && !next_alloc) {
         // case 2: previous is allocated, next is not
-        remove_from_list(bp);
-        remove_from_list(NEXT_BLKP(bp));
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK(size, 0));
+        char *next = NEXT_BLKP(bp);
+        remove_from_list(next);
+        size += GET_SIZE(HDRP(next));
+        zeroed &= GET(HDRP(next));
+        if (zeroed) zero_seam(next);
+        PUT(HDRP(bp), PACK(size, PREV_ALLOC | zeroed));
         PUT(FTRP(bp), PACK(size,0));
-        add_to_list(bp);
     } else if (!prev_alloc && next_alloc) {
         // case 3: next is allocated, previous is not
-        remove_from_list(bp);
-        remove_from_list(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
-        add_to_list(bp);
+        char *prev = PREV_BLKP(bp);
+        remove_from_list(prev);
+        size += GET_SIZE(HDRP(prev));
+        zeroed &= GET(HDRP(prev));
+        if (zeroed) zero_seam(bp);
+        PUT(HDRP(prev), PACK(size, PREV_ALLOC | zeroed));
+        PUT(FTRP(prev), PACK(size, 0));
+        bp = prev;
     } else {
         // case 4: both prev and next are free
-        remove_from_list(NEXT_BLKP(bp));
-        remove_from_list(bp);
-        remove_from_list(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+        char *prev = PREV_BLKP(bp), *next = NEXT_BLKP(bp);
+        remove_from_list(next);
+        remove_from_list(prev);
+        size += GET_SIZE(HDRP(prev)) + GET_SIZE(HDRP(next));
+        zeroed &= GET(HDRP(prev)) & GET(HDRP(next));
+        if (zeroed) {
+            zero_seam(next);
+            zero_seam(bp);
+        }
+        PUT(HDRP(prev), PACK(size, PREV_ALLOC | zeroed));
+        PUT(FTRP(prev), PACK(size, 0));
+        bp = prev;
+    }
+
+    // the next block now follows a free block
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
+    add_to_list(bp);
+    return bp;
+}
+
+/*
+ * zero_seam - Clear the header and links of free block bp and the footer of
+ * the free block before it, as the two become one ZEROED block. The footer of
+ * bp is left for the caller to clear or reuse.
+ */
+static void zero_seam(void *bp) {
+    memset((char *)bp - DSIZE, 0, DSIZE + MIN(4*WSIZE, GET_SIZE(HDRP(bp)) - DSIZE));
+}
+
+/*
+ * free_block - Mark an allocated block as free and coalesce it. Returns the
+ * coalesced block.
+ */
+static void *free_block(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+    return coalesce(bp);
+}
+
+/*
+ * shrink_block - Shrink allocated block bp to asize bytes, freeing the rest
+ * if it is big enough to be a block of its own
+ */
+static void shrink_block(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    if (csize - asize < 2*DSIZE) return;
+
+    PUT(HDRP(bp), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(bp))));
+
+    // the rest follows an allocated block
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(csize-asize, PREV_ALLOC));
+    PUT(FTRP(bp), PACK(csize-asize, 0));
+    coalesce(bp);
+}
+
+#if LOCKFREE
+/*
+ * quick_pop - Take the first block off a quick list of the current arena, or
+ * return NULL if it is empty. Needs no lock: the head's tag changes on every
+ * pop, so a block that was popped and pushed again in the meantime can't
+ * pass for the head that was read. The link of a block another thread has
+ * just popped may be garbage, but then the head has moved on.
+ */
+static void *quick_pop(int index) {
+    unsigned long long head = __atomic_load_n(&arena->quickhead[index], __ATOMIC_ACQUIRE);
+    unsigned int next;
+    void *bp;
+
+    do {
+        if (HEAD_OFF(head) == 0) return NULL;
+        bp = arena->heap_listp + (long)(int)HEAD_OFF(head)*DSIZE;
+        next = __atomic_load_n((unsigned int *)NXTP(bp), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&arena->quickhead[index], &head,
+                                          PACK_HEAD(next, HEAD_TAG(head) + 1), 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&arena->quickcnt[index], 1, __ATOMIC_RELAXED);
+    return bp;
+}
+
+/*
+ * quick_push - Put a freed block on its quick list of the current arena
+ * without coalescing or taking a lock. Returns the length of the list.
+ */
+static int quick_push(void *bp) {
+    int index = get_index(GET_SIZE(HDRP(bp)));
+    unsigned long long head = __atomic_load_n(&arena->quickhead[index], __ATOMIC_RELAXED);
+    unsigned int off = ((char *)bp - arena->heap_listp) / DSIZE;
+
+    do {
+        __atomic_store_n((unsigned int *)NXTP(bp), HEAD_OFF(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&arena->quickhead[index], &head,
+                                          PACK_HEAD(off, HEAD_TAG(head)), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return __atomic_add_fetch(&arena->quickcnt[index], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * quick_flush - Free and coalesce every block in the given quick list. The
+ * caller holds the arena lock, and takes the whole list in one go.
+ */
+static void quick_flush(int index) {
+    unsigned long long head = __atomic_load_n(&arena->quickhead[index], __ATOMIC_ACQUIRE);
+    int count = 0;
+    void *bp, *next;
+
+    while (!__atomic_compare_exchange_n(&arena->quickhead[index], &head,
+                                        PACK_HEAD(0, HEAD_TAG(head) + 1), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    arena->refill_k[index] = MAX(arena->refill_k[index] / 2, REFILL_MIN);
+
+    bp = HEAD_OFF(head) ? arena->heap_listp + (long)(int)HEAD_OFF(head)*DSIZE : NULL;
+    for (; bp != NULL; bp = next, count++) {
+        next = GET_PTR(NXTP(bp));
+        free_block(bp);
+    }
+    __atomic_sub_fetch(&arena->quickcnt[index], count, __ATOMIC_RELAXED);
+}
+
+/*
+ * quick_flush_all - Free and coalesce every quick list. Returns 0 if they
+ * were all empty.
+ */
+static int quick_flush_all(void) {
+    int flushed = 0;
+
+    for (int i = 0; i < QUICK_LISTS; i++) {
+        if (HEAD_OFF(__atomic_load_n(&arena->quickhead[i], __ATOMIC_RELAXED)) == 0) continue;
+        quick_flush(i);
+        flushed = 1;
+    }
+    return flushed;
+}
+#else
+/*
+ * quick_pop - Take the first block off a quick list, or return NULL if it is
+ * empty.
+ */
+static void *quick_pop(int index) {
+    void *bp = arena->quicklistp[index];
+
+    if (bp == NULL) return NULL;
+    arena->quicklistp[index] = GET_PTR(NXTP(bp));
+    if (arena->quicklistp[index] == NULL) arena->quickmap &= ~(1ULL << index);
+    arena->quickcnt[index]--;
+    return bp;
+}
+
+/*
+ * quick_push - Put a freed block on its quick list without coalescing.
+ * Returns the length of the list, which the caller coalesces once it gets
+ * too long.
+ */
+static int quick_push(void *bp) {
+    int index = get_index(GET_SIZE(HDRP(bp)));
+
+    PUT_PTR(NXTP(bp), arena->quicklistp[index]);
+    arena->quicklistp[index] = bp;
+    arena->quickmap |= 1ULL << index;
+
+    return ++arena->quickcnt[index];
+}
+
+/*
+ * quick_flush - Free and coalesce every block in the given quick list
+ */
+static void quick_flush(int index) {
+    void *bp = arena->quicklistp[index];
+    void *next;
+
+    arena->quicklistp[index] = NULL;
+    arena->quickcnt[index] = 0;
+    arena->quickmap &= ~(1ULL << index);
+    arena->refill_k[index] = MAX(arena->refill_k[index] / 2, REFILL_MIN);
+
+    for (; bp != NULL; bp = next) {
+        next = GET_PTR(NXTP(bp));
+        free_block(bp);
+    }
+}
+
+/*
+ * quick_flush_all - Free and coalesce every quick list. Returns 0 if they
+ * were all empty.
+ */
+static int quick_flush_all(void) {
+    if (arena->quickmap == 0) return 0;
+    
+    while (arena->quickmap != 0) quick_flush(__builtin_ctzll(arena->quickmap));
+    return 1;
+}
+#endif
+
+/*
+ * quick_refill - Allocate a block of asize bytes, whose exact bucket is
+ * empty, by carving it and more blocks of the same size out of one free block,
+ * and put the others on its quick list. The number of blocks carved doubles
+ * with every refill, and halves whenever the quick list is coalesced, which
+ * means the blocks weren't needed. Returns NULL if no free block is big
+ * enough.
+ */
+static void *quick_refill(int index, size_t asize) {
+    void *blocks[REFILL_MAX];
+    int k = arena->refill_k[index];
+    void *bp;
+
+    if ((bp = find_fit(asize * k)) == NULL) return NULL;
+    place_batch(bp, asize, k, blocks);
+    arena->refill_k[index] = MIN(2*k, REFILL_MAX);
+
+    // the lowest block is taken first; the last one may have taken the rest
+    // of the free block, and be too big for a quick list
+    for (int i = k - 1; i > 0; i--) {
+        if (get_index(GET_SIZE(HDRP(blocks[i]))) < QUICK_LISTS) quick_push(blocks[i]);
+        else free_block(blocks[i]);
+    }
+    return blocks[0];
+}
+
+/*
+ * can_trim - Return whether trim_heap may shrink the current arena's heap.
+ * Only the first arena's heap is grown with mem_sbrk, and a lock-free pop may
+ * still read the link of a block that just left its quick list, so that
+ * engine never gives memory back.
+ */
+static int can_trim(void) {
+    return !LOCKFREE && arena == &arenas[0];
+}
+
+/*
+ * consolidate - Coalesce the quick lists once a free has made free block bp
+ * (NULL if none) QUICK_BYTES bytes large, or has freed the last live block, so
+ * that blocks waiting in them at the end of the heap don't keep trim_heap from
+ * shrinking it
+ */
+static void consolidate(void *bp) {
+    if (DEFER_COALESCE && can_trim() &&
+        (arena->live == 0 || (bp != NULL && GET_SIZE(HDRP(bp)) >= QUICK_BYTES))) quick_flush_all();
+}
+
+/*
+ * at_heap_end - Return whether bp is the last block of a heap trim_heap
+ * shrinks, or would be but for a free block after it
+ */
+static int at_heap_end(void *bp) {
+    if (!can_trim()) return 0;
+    
+    char *epilogue = (char *)mem_heap_hi() + 1;
+    char *next = NEXT_BLKP(bp);
+    return next == epilogue || (!GET_ALLOC(HDRP(next)) && NEXT_BLKP(next) == epilogue);
+}
+
+/*
+ * trim_heap - Shrink the heap if it ends in a free block of at least
+ * TRIM_THRESHOLD bytes, keeping TRIM_KEEP bytes of that block.
+ */
+static void trim_heap() {
+    if (!can_trim()) return;
+
+    // once no block is live, the empty runs kept for their classes go too
+    if (arena->live == 0) trim_runs();
+    
+    char *epilogue = (char *)mem_heap_hi() + 1;
+    if (GET_PREV_ALLOC(HDRP(epilogue))) return;
+    
+    char *bp = PREV_BLKP(epilogue);
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size < TRIM_THRESHOLD) return;
+
+    remove_from_list(bp);
+    MEM_LOCK();
+    char *brk = mem_trim(size - TRIM_KEEP);
+    MEM_UNLOCK();
+    if ((long)brk == -1) {
         add_to_list(bp);
+        return;
     }
+    
+    PUT(HDRP(bp), PACK(TRIM_KEEP, GET(HDRP(bp)) & (PREV_ALLOC | ZEROED)));
+    PUT(FTRP(bp), PACK(TRIM_KEEP, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
+    add_to_list(bp);
+}
+
+/*
+ * map_block - Give a huge request of size bytes a region of its own. Returns
+ * NULL if the region can't be mapped, or would be too large for its header.
+ */
+static void *map_block(size_t size) {
+    if (size > MAP_MAX) return NULL;
+    
+    size_t msize = MAP_SIZE(size);
+    char *bp;
+    
+    MEM_LOCK();
+    bp = mem_map(msize);
+    MEM_UNLOCK();
+    if (bp == NULL) return NULL;
+    
+    bp += ALIGNMENT;
+    PUT(HDRP(bp), PACK_MAP(msize));
+    return bp;
+}
 
+/*
+ * remap_block - Resize the region of huge block bp to hold size bytes, moving
+ * it if need be. Returns NULL, leaving bp alone, if that fails.
+ */
+static void *remap_block(void *bp, size_t size) {
+    if (size > MAP_MAX) return NULL;
+    
+    size_t msize = MAP_SIZE(size);
+    
+    if (msize == GET_MAP_SIZE(HDRP(bp))) return bp;
+    MEM_LOCK();
+    bp = mem_remap((char *)bp - ALIGNMENT, msize);
+    MEM_UNLOCK();
+    if (bp == NULL) return NULL;
+    
+    bp = (char *)bp + ALIGNMENT;
+    PUT(HDRP(bp), PACK_MAP(msize));
     return bp;
 }
 
@@ -518,21 +2833,76 @@ static void place(void *bp, size_t asize) {
     if ((csize - asize) >= (2*DSIZE)) {
         // split case
         // allocated block
+        size_t zeroed = GET_ZEROED(HDRP(bp));
         remove_from_list(bp);
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
+        PUT(HDRP(bp), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(bp))));
         
-        // new free block
+        // new free block, as zeroed as the old one
         bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 0));
+        PUT(HDRP(bp), PACK(csize-asize, PREV_ALLOC | zeroed));
         PUT(FTRP(bp), PACK(csize-asize, 0));
         coalesce(bp);
-        add_to_list(bp);
     } else {
         // don't split case
         remove_from_list(bp);
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+        PUT(HDRP(bp), PACK(csize, 1 | GET_PREV_ALLOC(HDRP(bp))));
+        SET_PREV_ALLOC(NEXT_BLKP(bp));
+    }
+}
+
+/*
+ * place_high - Place block of asize bytes at the end of free block bp, and
+ * return it. The rest stays a free block below it, if it would be at least
+ * the minimum block size; otherwise bp is placed whole.
+ */
+static void *place_high(void *bp, size_t asize) {
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    if ((csize - asize) < (2*DSIZE)) {
+        place(bp, asize);
+        return bp;
+    }
+    
+    // the free block shrinks, as zeroed as it was
+    remove_from_list(bp);
+    PUT(HDRP(bp), PACK(csize-asize, GET(HDRP(bp)) & (PREV_ALLOC | ZEROED)));
+    PUT(FTRP(bp), PACK(csize-asize, 0));
+    add_to_list(bp);
+
+    // allocated block, after a free one
+    bp = NEXT_BLKP(bp);
+    PUT(HDRP(bp), PACK(asize, 1));
+    SET_PREV_ALLOC(NEXT_BLKP(bp));
+    return bp;
+}
+
+/*
+ * place_batch - Place n blocks of asize bytes each at the start of free block
+ * bp, storing them in out, and split off the rest if it is at least the
+ * minimum block size. Otherwise the last block gets the rest.
+ */
+static void place_batch(void *bp, size_t asize, int n, void **out) {
+    size_t rest = GET_SIZE(HDRP(bp)) - asize * n;
+    size_t zeroed = GET_ZEROED(HDRP(bp));
+    char *p = bp;
+    
+    remove_from_list(bp);
+    PUT(HDRP(p), PACK(asize, 1 | GET_PREV_ALLOC(HDRP(p))));
+    for (int i = 0; i < n; i++, p += asize) {
+        if (i > 0) PUT(HDRP(p), PACK(asize, 1 | PREV_ALLOC));
+        out[i] = p;
+    }
+
+    if (rest >= 2*DSIZE) {
+        // new free block
+        PUT(HDRP(p), PACK(rest, PREV_ALLOC | zeroed));
+        PUT(FTRP(p), PACK(rest, 0));
+        coalesce(p);
+    } else {
+        // the last block takes the rest
+        p = out[n-1];
+        PUT(HDRP(p), PACK(asize + rest, 1 | GET_PREV_ALLOC(HDRP(p))));
+        SET_PREV_ALLOC(NEXT_BLKP(p));
     }
 }
 
@@ -543,15 +2913,23 @@ static void add_to_list(void *bp) {
     size_t size = GET_SIZE(HDRP(bp));
     int index = get_index(size);
 
+    // larger blocks go in the bucket's tree
+    if (index >= TREE_INDEX) {
+        tree_insert(&arena->freelistp[index], bp);
+        arena->freemap[index/32] |= 1u << (index%32);
+        return;
+    }
+
     // set new block as prev block of first
-    if (freelistp[index] != NULL) PUT_ADDR(PRVP(freelistp[index]), bp);
+    if (arena->freelistp[index] != NULL) PUT_PTR(PRVP(arena->freelistp[index]), bp);
 
     // set next block of bp to old first block
-    PUT_ADDR(NXTP(bp), freelistp[index]);
+    PUT_PTR(NXTP(bp), arena->freelistp[index]);
     
     // set start of list to bp
-    PUT_ADDR(PRVP(bp), NULL);
-    freelistp[index] = (void *)(bp);
+    PUT_PTR(PRVP(bp), NULL);
+    arena->freelistp[index] = (void *)(bp);
+    arena->freemap[index/32] |= 1u << (index%32);
 }
 
 /*
@@ -561,25 +2939,209 @@ static void remove_from_list(void *bp) {
     size_t size = GET_SIZE(HDRP(bp));
     int index = get_index(size);
 
+    // larger blocks come out of the bucket's tree
+    if (index >= TREE_INDEX) {
+        tree_remove(&arena->freelistp[index], bp);
+        if (arena->freelistp[index] == NULL) arena->freemap[index/32] &= ~(1u << (index%32));
+        return;
+    }
+
     // remove from prev
-    if (*PRVP(bp) != NULL) PUT_ADDR(NXTP(*PRVP(bp)), *NXTP(bp));
+    if (GET_PTR(PRVP(bp)) != NULL) PUT_PTR(NXTP(GET_PTR(PRVP(bp))), GET_PTR(NXTP(bp)));
     
     // remove from next
-    if (*NXTP(bp) != NULL) PUT_ADDR(PRVP(*NXTP(bp)), *PRVP(bp));
+    if (GET_PTR(NXTP(bp)) != NULL) PUT_PTR(PRVP(GET_PTR(NXTP(bp))), GET_PTR(PRVP(bp)));
     
-    // set start of list if needed
-    if (bp == freelistp[index]) freelistp[index] = *NXTP(bp);
+    // set start of list if needed, and mark the list empty if it is
+    if (bp == arena->freelistp[index]) {
+        arena->freelistp[index] = GET_PTR(NXTP(bp));
+        if (arena->freelistp[index] == NULL) arena->freemap[index/32] &= ~(1u << (index%32));
+    }
 }
 
 /**
- * Helper that computes the index of a given size.
+ * Helper that computes the index of a given size. Above the exact bins, the
+ * index grows by one per power of two, found with a bit scan.
  */
 static int get_index(size_t size) {
     int index;
 
     // fixed bins for up to 512
-    if (size < 512) index = size/8 - 1;
-    else index = (int)(log2(1.0*size)) + 61;
+    if (size < EXACT_LIMIT) index = size/8 - 1;
+    else index = (int)(8*sizeof(unsigned long) - 1) - __builtin_clzl(size) + 61;
     
     return index;
 }
+
+/**
+ * Helper that returns the first non-empty free list at or after index, or -1
+ * if there is none.
+ */
+static int next_nonempty(int index) {
+    if (index >= NUM_FREE_LISTS) return -1;
+
+    int word = index/32;
+    unsigned int bits = arena->freemap[word] & (~0u << (index%32));
+    
+    while (bits == 0) {
+        if (++word == NUM_MAP_WORDS) return -1;
+        bits = arena->freemap[word];
+    }
+    
+    return word*32 + __builtin_ctz(bits);
+}
+
+/**
+ * splay - Top-down splay of the tree rooted at t around the given size.
+ * Returns the new root, which is the node of that size if there is one, and
+ * otherwise the node visited last on the way down (its predecessor or
+ * successor).
+ */
+static void *splay(void *t, size_t size) {
+    unsigned int n[4] = {0, 0, 0, 0}; /* holds the left/right trees */
+    void *l = n, *r = n, *y;
+
+    for (;;) {
+        if (size < GET_SIZE(HDRP(t))) {
+            if (GET_PTR(LFTP(t)) == NULL) break;
+
+            // rotate right
+            if (size < GET_SIZE(HDRP(GET_PTR(LFTP(t))))) {
+                y = GET_PTR(LFTP(t));
+                PUT_PTR(LFTP(t), GET_PTR(RGTP(y)));
+                PUT_PTR(RGTP(y), t);
+                t = y;
+                if (GET_PTR(LFTP(t)) == NULL) break;
+            }
+
+            // link right
+            PUT_PTR(LFTP(r), t);
+            r = t;
+            t = GET_PTR(LFTP(t));
+        } else if (size > GET_SIZE(HDRP(t))) {
+            if (GET_PTR(RGTP(t)) == NULL) break;
+
+            // rotate left
+            if (size > GET_SIZE(HDRP(GET_PTR(RGTP(t))))) {
+                y = GET_PTR(RGTP(t));
+                PUT_PTR(RGTP(t), GET_PTR(LFTP(y)));
+                PUT_PTR(LFTP(y), t);
+                t = y;
+                if (GET_PTR(RGTP(t)) == NULL) break;
+            }
+
+            // link left
+            PUT_PTR(RGTP(l), t);
+            l = t;
+            t = GET_PTR(RGTP(t));
+        } else {
+            break;
+        }
+    }
+
+    // reassemble
+    PUT_PTR(RGTP(l), GET_PTR(LFTP(t)));
+    PUT_PTR(LFTP(r), GET_PTR(RGTP(t)));
+    PUT_PTR(LFTP(t), GET_PTR(RGTP(n)));
+    PUT_PTR(RGTP(t), GET_PTR(LFTP(n)));
+    return t;
+}
+
+/*
+ * tree_insert - add the given block to the tree at rootp. If a node of the
+ * same size exists, the block joins that node's list instead.
+ */
+static void tree_insert(void **rootp, void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    void *t;
+
+    PUT_PTR(PRVP(bp), NULL);
+    PUT_PTR(NXTP(bp), NULL);
+
+    // first node of the tree
+    if (*rootp == NULL) {
+        PUT_PTR(LFTP(bp), NULL);
+        PUT_PTR(RGTP(bp), NULL);
+        *rootp = bp;
+        return;
+    }
+
+    t = splay(*rootp, size);
+
+    if (size == GET_SIZE(HDRP(t))) {
+        // same size as an existing node, so link in right after it
+        PUT_PTR(NXTP(bp), GET_PTR(NXTP(t)));
+        if (GET_PTR(NXTP(t)) != NULL) PUT_PTR(PRVP(GET_PTR(NXTP(t))), bp);
+        PUT_PTR(PRVP(bp), t);
+        PUT_PTR(NXTP(t), bp);
+        *rootp = t;
+    } else {
+        // new size, so split the tree around bp and make it the root
+        if (size < GET_SIZE(HDRP(t))) {
+            PUT_PTR(LFTP(bp), GET_PTR(LFTP(t)));
+            PUT_PTR(RGTP(bp), t);
+            PUT_PTR(LFTP(t), NULL);
+        } else {
+            PUT_PTR(RGTP(bp), GET_PTR(RGTP(t)));
+            PUT_PTR(LFTP(bp), t);
+            PUT_PTR(RGTP(t), NULL);
+        }
+        *rootp = bp;
+    }
+}
+
+/*
+ * tree_remove - remove the given block from the tree at rootp
+ */
+static void tree_remove(void **rootp, void *bp) {
+    void *t;
+
+    // blocks in a node's list come out like any list element
+    if (GET_PTR(PRVP(bp)) != NULL) {
+        PUT_PTR(NXTP(GET_PTR(PRVP(bp))), GET_PTR(NXTP(bp)));
+        if (GET_PTR(NXTP(bp)) != NULL) PUT_PTR(PRVP(GET_PTR(NXTP(bp))), GET_PTR(PRVP(bp)));
+        return;
+    }
+
+    // bring the node to the root
+    splay(*rootp, GET_SIZE(HDRP(bp)));
+
+    if (GET_PTR(NXTP(bp)) != NULL) {
+        // the next block of the same size takes the node's place
+        t = GET_PTR(NXTP(bp));
+        PUT_PTR(PRVP(t), NULL);
+        PUT_PTR(LFTP(t), GET_PTR(LFTP(bp)));
+        PUT_PTR(RGTP(t), GET_PTR(RGTP(bp)));
+    } else if (GET_PTR(LFTP(bp)) == NULL) {
+        t = GET_PTR(RGTP(bp));
+    } else {
+        // the largest node on the left has no right child, so hang the
+        // right subtree there
+        t = splay(GET_PTR(LFTP(bp)), GET_SIZE(HDRP(bp)));
+        PUT_PTR(RGTP(t), GET_PTR(RGTP(bp)));
+    }
+
+    *rootp = t;
+}
+
+/*
+ * tree_fit - Return the smallest block in the tree at rootp with at least
+ * asize bytes, or NULL if there is none.
+ */
+static void *tree_fit(void **rootp, size_t asize) {
+    void *t;
+
+    if (*rootp == NULL) return NULL;
+
+    // the root becomes the best fit, or the largest block that is too small
+    t = *rootp = splay(*rootp, asize);
+
+    if (GET_SIZE(HDRP(t)) < asize) {
+        if ((t = GET_PTR(RGTP(t))) == NULL) return NULL;
+        while (GET_PTR(LFTP(t)) != NULL) t = GET_PTR(LFTP(t));
+    }
+
+    // prefer a block from the node's list, which can leave without any
+    // tree restructuring
+    return (GET_PTR(NXTP(t)) != NULL) ? GET_PTR(NXTP(t)) : t;
+}
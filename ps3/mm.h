@@ -2,8 +2,27 @@
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
+extern void *mm_malloc_hint(size_t size, int hint);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_calloc(size_t n, size_t size);
+extern int mm_malloc_batch(size_t size, int n, void *out[]);
+extern void mm_free_batch(void *ptrs[], int n);
+extern int mm_checkheap(void);
+
+/* lifetime hints for mm_malloc_hint */
+#define MM_AUTO        0    /* as learned for the size */
+#define MM_SHORT_LIVED 1
+#define MM_LONG_LIVED  2
+
+typedef struct mm_region mm_region_t;
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern void mm_region_reset(mm_region_t *r);
+extern void mm_region_destroy(mm_region_t *r);
 
 
 /* 